@@ -0,0 +1,501 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "game2048.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+// lanes are processed in blocks of one 256-bit vector of cells
+const int BATCH_BLOCK = 32;
+const int BATCH_CELLS = 16; // 4x4 boards only
+
+const int BATCH_RANDOM = 0; // uniform over legal moves
+const int BATCH_GREEDY = 1; // most empty cells after the move, then score
+
+// cells of line `line` for direction `dir`, starting from the wall
+// the tiles are pushed towards (0 up, 1 right, 2 down, 3 left)
+const int BATCH_LINE[4][4][4] = {
+    {{0, 4, 8, 12}, {1, 5, 9, 13}, {2, 6, 10, 14}, {3, 7, 11, 15}},
+    {{3, 2, 1, 0}, {7, 6, 5, 4}, {11, 10, 9, 8}, {15, 14, 13, 12}},
+    {{12, 8, 4, 0}, {13, 9, 5, 1}, {14, 10, 6, 2}, {15, 11, 7, 3}},
+    {{0, 1, 2, 3}, {4, 5, 6, 7}, {8, 9, 10, 11}, {12, 13, 14, 15}},
+};
+
+
+#ifdef __AVX2__
+typedef __m256i lane_vec;
+
+inline lane_vec lv_load(const uint8_t *p) { return _mm256_loadu_si256((const __m256i*)p); }
+inline void lv_store(uint8_t *p, lane_vec a) { _mm256_storeu_si256((__m256i*)p, a); }
+inline lane_vec lv_set(uint8_t x) { return _mm256_set1_epi8(char(x)); }
+inline lane_vec lv_eq(lane_vec a, lane_vec b) { return _mm256_cmpeq_epi8(a, b); }
+inline lane_vec lv_and(lane_vec a, lane_vec b) { return _mm256_and_si256(a, b); }
+inline lane_vec lv_or(lane_vec a, lane_vec b) { return _mm256_or_si256(a, b); }
+inline lane_vec lv_andnot(lane_vec m, lane_vec a) { return _mm256_andnot_si256(m, a); }
+inline lane_vec lv_sub(lane_vec a, lane_vec b) { return _mm256_sub_epi8(a, b); }
+// m ? b : a
+inline lane_vec lv_blend(lane_vec a, lane_vec b, lane_vec m) { return _mm256_blendv_epi8(a, b, m); }
+inline uint32_t lv_mask(lane_vec m) { return uint32_t(_mm256_movemask_epi8(m)); }
+#else
+// portable fallback, plain loops the compiler can vectorize
+struct lane_vec
+{
+    uint8_t v[BATCH_BLOCK];
+};
+
+inline lane_vec lv_load(const uint8_t *p) { lane_vec r; memcpy(r.v, p, BATCH_BLOCK); return r; }
+inline void lv_store(uint8_t *p, lane_vec a) { memcpy(p, a.v, BATCH_BLOCK); }
+inline lane_vec lv_set(uint8_t x) { lane_vec r; memset(r.v, x, BATCH_BLOCK); return r; }
+inline lane_vec lv_eq(lane_vec a, lane_vec b)
+{
+    for (int i = 0; i < BATCH_BLOCK; ++i) a.v[i] = a.v[i] == b.v[i]? 0xff: 0;
+    return a;
+}
+inline lane_vec lv_and(lane_vec a, lane_vec b)
+{
+    for (int i = 0; i < BATCH_BLOCK; ++i) a.v[i] &= b.v[i];
+    return a;
+}
+inline lane_vec lv_or(lane_vec a, lane_vec b)
+{
+    for (int i = 0; i < BATCH_BLOCK; ++i) a.v[i] |= b.v[i];
+    return a;
+}
+inline lane_vec lv_andnot(lane_vec m, lane_vec a)
+{
+    for (int i = 0; i < BATCH_BLOCK; ++i) a.v[i] &= ~m.v[i];
+    return a;
+}
+inline lane_vec lv_sub(lane_vec a, lane_vec b)
+{
+    for (int i = 0; i < BATCH_BLOCK; ++i) a.v[i] -= b.v[i];
+    return a;
+}
+inline lane_vec lv_blend(lane_vec a, lane_vec b, lane_vec m)
+{
+    for (int i = 0; i < BATCH_BLOCK; ++i) a.v[i] = m.v[i]? b.v[i]: a.v[i];
+    return a;
+}
+inline uint32_t lv_mask(lane_vec m)
+{
+    uint32_t r = 0;
+    for (int i = 0; i < BATCH_BLOCK; ++i) r |= uint32_t(m.v[i] >> 7) << i;
+    return r;
+}
+#endif
+
+
+struct batch_result
+{
+    uint32_t score;
+    int max_val;
+    uint32_t moves;
+};
+
+
+// N independent 4x4 games in structure-of-arrays form: cell k of lane l
+// is cells[k*lanes + l]. Every step() moves all live lanes at once;
+// finished games are recorded in `results` and their lanes restarted
+// from the start position while queued games remain.
+class batch2048
+{
+public:
+    batch2048(int _lanes=256, uint32_t seed=1);
+    ~batch2048();
+
+    void set_start(const game2048 &game, int spawn_num=1);
+    void set_policy(int _policy);
+
+    void start(long long games);
+    int step(void);
+    void run(void);
+
+    inline int get_lanes(void) const;
+    void get_lane(int lane, game2048 &game) const;
+
+    std::vector<batch_result> results;
+    long long move_count;
+
+private:
+    int lanes;
+    int policy;
+    long long queued;
+
+    uint8_t* cells;
+    uint32_t* score;
+    uint32_t* moves;
+    uint32_t* rng;
+    uint8_t* active;
+    uint8_t* spawns; // tiles still to be spawned in the lane
+
+    uint8_t start_cells[BATCH_CELLS];
+    uint32_t start_score;
+    int start_spawns;
+
+    inline uint32_t next_rand(int lane);
+    void refill(int lane);
+    void finish(int lane);
+    void spawn_block(int b);
+    int step_block(int b);
+};
+
+
+batch2048::batch2048(int _lanes /*=256*/, uint32_t seed /*=1*/)
+{
+    lanes = (_lanes + BATCH_BLOCK - 1) / BATCH_BLOCK * BATCH_BLOCK;
+    policy = BATCH_RANDOM;
+    queued = 0;
+    move_count = 0;
+    cells = new uint8_t [BATCH_CELLS * lanes];
+    score = new uint32_t [lanes];
+    moves = new uint32_t [lanes];
+    rng = new uint32_t [lanes];
+    active = new uint8_t [lanes];
+    spawns = new uint8_t [lanes];
+    memset(cells, 0, BATCH_CELLS * lanes);
+    for (int l = 0; l < lanes; ++l)
+    {
+        score[l] = 0;
+        moves[l] = 0;
+        active[l] = 0;
+        spawns[l] = 0;
+        // xorshift32 must not start at 0
+        rng[l] = (seed * 0x9e3779b9u) ^ (uint32_t(l + 1) * 0x85ebca6bu);
+        if (!rng[l])
+        {
+            rng[l] = 1;
+        }
+    }
+    memset(start_cells, 0, sizeof(start_cells));
+    start_score = 0;
+    start_spawns = 2;
+}
+
+batch2048::~batch2048()
+{
+    delete []cells;
+    delete []score;
+    delete []moves;
+    delete []rng;
+    delete []active;
+    delete []spawns;
+}
+
+
+void batch2048::set_start(const game2048 &game, int spawn_num /*=1*/)
+{
+    // position before spawning: an afterstate for rollouts,
+    // an empty board with spawn_num=2 for fresh games
+    for (int k = 0; k < BATCH_CELLS; ++k)
+    {
+        start_cells[k] = uint8_t(game.get(k / 4, k % 4));
+    }
+    start_score = game.get_score();
+    start_spawns = spawn_num;
+}
+
+void batch2048::set_policy(int _policy)
+{
+    policy = _policy;
+}
+
+
+inline int batch2048::get_lanes(void) const
+{
+    return lanes;
+}
+
+void batch2048::get_lane(int lane, game2048 &game) const
+{
+    game.clear_board();
+    for (int k = 0; k < BATCH_CELLS; ++k)
+    {
+        game.set(k / 4, k % 4, cells[k*lanes + lane]);
+    }
+}
+
+
+inline uint32_t batch2048::next_rand(int lane)
+{
+    uint32_t x = rng[lane];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng[lane] = x;
+}
+
+
+void batch2048::refill(int lane)
+{
+    if (queued <= 0)
+    {
+        active[lane] = 0;
+        return;
+    }
+    --queued;
+    for (int k = 0; k < BATCH_CELLS; ++k)
+    {
+        cells[k*lanes + lane] = start_cells[k];
+    }
+    score[lane] = start_score;
+    moves[lane] = 0;
+    spawns[lane] = uint8_t(start_spawns);
+    active[lane] = 1;
+}
+
+void batch2048::finish(int lane)
+{
+    batch_result r;
+    r.score = score[lane];
+    r.max_val = 0;
+    for (int k = 0; k < BATCH_CELLS; ++k)
+    {
+        if (cells[k*lanes + lane] > r.max_val)
+        {
+            r.max_val = cells[k*lanes + lane];
+        }
+    }
+    r.moves = moves[lane];
+    results.push_back(r);
+    refill(lane);
+}
+
+
+void batch2048::start(long long games)
+{
+    queued += games;
+    for (int l = 0; l < lanes; ++l)
+    {
+        if (!active[l])
+        {
+            refill(l);
+        }
+    }
+    for (int b = 0; b < lanes; b += BATCH_BLOCK)
+    {
+        spawn_block(b);
+    }
+}
+
+
+// places one tile in every lane of the block with pending spawns:
+// the r-th empty cell gets a 2 (90%) or a 4 (10%)
+void batch2048::spawn_block(int b)
+{
+    uint8_t target[BATCH_BLOCK];
+    uint8_t val[BATCH_BLOCK];
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        lane_vec zero = lv_set(0);
+        lane_vec empty_num = zero;
+        for (int k = 0; k < BATCH_CELLS; ++k)
+        {
+            empty_num = lv_sub(empty_num, lv_eq(lv_load(cells + k*lanes + b), zero));
+        }
+        uint8_t cnt[BATCH_BLOCK];
+        lv_store(cnt, empty_num);
+        bool any = false;
+        for (int l = 0; l < BATCH_BLOCK; ++l)
+        {
+            // 0xff never matches the running count
+            target[l] = 0xff;
+            val[l] = 0;
+            if (spawns[b + l] && cnt[l])
+            {
+                uint32_t x = next_rand(b + l);
+                target[l] = uint8_t((x >> 16) % cnt[l]);
+                val[l] = (x & 0xffff) % 10? 1: 2;
+                --spawns[b + l];
+                any = true;
+            }
+            else
+            {
+                spawns[b + l] = 0;
+            }
+        }
+        if (!any)
+        {
+            return;
+        }
+        lane_vec t = lv_load(target);
+        lane_vec v = lv_load(val);
+        lane_vec seen = zero;
+        for (int k = 0; k < BATCH_CELLS; ++k)
+        {
+            lane_vec c = lv_load(cells + k*lanes + b);
+            lane_vec z = lv_eq(c, zero);
+            lane_vec hit = lv_and(z, lv_eq(seen, t));
+            lv_store(cells + k*lanes + b, lv_blend(c, v, hit));
+            seen = lv_sub(seen, z);
+        }
+    }
+}
+
+
+// slides one line towards a, merging equal pairs once;
+// m[i] flags the lanes where a merge produced the new tile in slot i
+inline void slide_line(lane_vec &a, lane_vec &b, lane_vec &c, lane_vec &d, lane_vec m[3])
+{
+    lane_vec zero = lv_set(0);
+    lane_vec z;
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        z = lv_eq(a, zero); a = lv_blend(a, b, z); b = lv_andnot(z, b);
+        z = lv_eq(b, zero); b = lv_blend(b, c, z); c = lv_andnot(z, c);
+        z = lv_eq(c, zero); c = lv_blend(c, d, z); d = lv_andnot(z, d);
+    }
+    m[0] = lv_andnot(lv_eq(a, zero), lv_eq(a, b));
+    a = lv_sub(a, m[0]);
+    b = lv_blend(b, c, m[0]);
+    c = lv_blend(c, d, m[0]);
+    d = lv_andnot(m[0], d);
+    m[1] = lv_andnot(lv_eq(b, zero), lv_eq(b, c));
+    b = lv_sub(b, m[1]);
+    c = lv_blend(c, d, m[1]);
+    d = lv_andnot(m[1], d);
+    m[2] = lv_andnot(lv_eq(c, zero), lv_eq(c, d));
+    c = lv_sub(c, m[2]);
+    d = lv_andnot(m[2], d);
+}
+
+
+int batch2048::step_block(int b)
+{
+    lane_vec cur[BATCH_CELLS];
+    lane_vec res[4][BATCH_CELLS];
+    uint32_t gain[4][BATCH_BLOCK];
+    uint8_t empty_after[4][BATCH_BLOCK];
+    uint32_t legal[4];
+    lane_vec zero = lv_set(0);
+    for (int k = 0; k < BATCH_CELLS; ++k)
+    {
+        cur[k] = lv_load(cells + k*lanes + b);
+    }
+    for (int dir = 0; dir < 4; ++dir)
+    {
+        memset(gain[dir], 0, sizeof(gain[dir]));
+        lane_vec changed = zero;
+        lane_vec empty_num = zero;
+        for (int line = 0; line < 4; ++line)
+        {
+            const int *idx = BATCH_LINE[dir][line];
+            lane_vec v[4] = {cur[idx[0]], cur[idx[1]], cur[idx[2]], cur[idx[3]]};
+            lane_vec m[3];
+            slide_line(v[0], v[1], v[2], v[3], m);
+            for (int i = 0; i < 4; ++i)
+            {
+                res[dir][idx[i]] = v[i];
+                changed = lv_or(changed, lv_andnot(lv_eq(v[i], cur[idx[i]]), lv_set(0xff)));
+                empty_num = lv_sub(empty_num, lv_eq(v[i], zero));
+            }
+            for (int i = 0; i < 3; ++i)
+            {
+                uint32_t bits = lv_mask(m[i]);
+                if (bits)
+                {
+                    uint8_t merged[BATCH_BLOCK];
+                    lv_store(merged, v[i]);
+                    for (; bits; bits &= bits - 1)
+                    {
+                        int l = __builtin_ctz(bits);
+                        gain[dir][l] += 1u << merged[l];
+                    }
+                }
+            }
+        }
+        legal[dir] = lv_mask(changed);
+        lv_store(empty_after[dir], empty_num);
+    }
+
+    uint8_t choice[BATCH_BLOCK];
+    int live = 0;
+    for (int l = 0; l < BATCH_BLOCK; ++l)
+    {
+        choice[l] = 0xff;
+        int lane = b + l;
+        if (!active[lane])
+        {
+            continue;
+        }
+        int mask = 0;
+        for (int dir = 0; dir < 4; ++dir)
+        {
+            mask |= int(legal[dir] >> l & 1) << dir;
+        }
+        if (!mask)
+        {
+            finish(lane);
+            live += active[lane];
+            continue;
+        }
+        int dir = -1;
+        if (policy == BATCH_GREEDY)
+        {
+            long long best = -1;
+            for (int d = 0; d < 4; ++d)
+            {
+                long long val = (long long)empty_after[d][l] << 32 | gain[d][l];
+                if (mask >> d & 1 && val > best)
+                {
+                    best = val;
+                    dir = d;
+                }
+            }
+        }
+        else
+        {
+            int r = int(next_rand(lane) >> 8) % __builtin_popcount(mask);
+            for (dir = 0; !(mask >> dir & 1) || r--; ++dir);
+        }
+        choice[l] = uint8_t(dir);
+        score[lane] += gain[dir][l];
+        ++moves[lane];
+        spawns[lane] = 1;
+        ++move_count;
+        ++live;
+    }
+
+    lane_vec ch = lv_load(choice);
+    lane_vec sel[4];
+    for (int dir = 0; dir < 4; ++dir)
+    {
+        sel[dir] = lv_eq(ch, lv_set(uint8_t(dir)));
+    }
+    for (int k = 0; k < BATCH_CELLS; ++k)
+    {
+        // refilled lanes were written by finish(), keep them
+        lane_vec v = lv_load(cells + k*lanes + b);
+        for (int dir = 0; dir < 4; ++dir)
+        {
+            v = lv_blend(v, res[dir][k], sel[dir]);
+        }
+        lv_store(cells + k*lanes + b, v);
+    }
+    spawn_block(b);
+    return live;
+}
+
+
+int batch2048::step(void)
+{
+    int live = 0;
+    for (int b = 0; b < lanes; b += BATCH_BLOCK)
+    {
+        live += step_block(b);
+    }
+    return live;
+}
+
+void batch2048::run(void)
+{
+    while (step());
+}
+
+
+
+#endif
@@ -0,0 +1,498 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include "game2048.h"
+#include "solver.h"
+#include "service.h"
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// Solves every position of a file. Records are the service's: a text
+// board `<size> <score> <cells...>` on one line, or a 13-byte
+// SERVICE_FRAME frame; blank lines are skipped.
+// Files are memory-mapped; pipes and stdin ("-") are read in blocks.
+// A reader thread cuts the input into batches, worker threads solve
+// them, each with its own transposition table, and the calling thread
+// writes the answers in input order, as the service would:
+//     <move> <value> <nodes> <latency_us>
+// or a 14-byte frame for a frame. Every record gets exactly one answer:
+// a line that is not a board gets "error bad board", a frame cut off
+// by the end of the input "error truncated frame".
+
+const int BULK_BATCH = 256; // positions per batch
+const int BULK_IN_FLIGHT = 4; // batches per worker read ahead
+const int BULK_READ_SIZE = 1 << 20;
+const int BULK_OUT_BUFFER = 1 << 20;
+
+
+namespace bulk
+{
+    struct position
+    {
+        bool frame;
+        int size;
+        int score;
+        const char *error; // the answer instead, for a bad record
+        uint8_t cells[SERVICE_MAX_SIZE*SERVICE_MAX_SIZE];
+    };
+
+    struct batch
+    {
+        long long seq;
+        std::vector<position> positions;
+        std::string out;
+    };
+
+
+    // the input as one byte range, mapped or refilled from a descriptor
+    class source
+    {
+    public:
+        source();
+        ~source();
+
+        bool open(const char *filename);
+        // next record into pos; false at the end of the input
+        bool next(position &pos);
+
+    private:
+        int fd;
+        const char *map;
+        size_t map_len;
+        std::string buf;
+        const char *p;
+        const char *end;
+        bool eof;
+
+        bool fill(size_t n);
+        bool skip_space(void);
+        void skip_blank(void);
+        void skip_line(void);
+        bool read_int(long &v);
+    };
+
+
+    source::source()
+    {
+        fd = -1;
+        map = NULL;
+        map_len = 0;
+        p = end = NULL;
+        eof = true;
+    }
+
+    source::~source()
+    {
+        if (map)
+        {
+            munmap((void*)map, map_len);
+        }
+        if (fd > 0)
+        {
+            close(fd);
+        }
+    }
+
+    bool source::open(const char *filename)
+    {
+        fd = strcmp(filename, "-")? ::open(filename, O_RDONLY): 0;
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED)
+            {
+                madvise(m, st.st_size, MADV_SEQUENTIAL);
+                map = (const char*)m;
+                map_len = st.st_size;
+                p = map;
+                end = map + map_len;
+                return true;
+            }
+        }
+        eof = false;
+        p = end = buf.data();
+        return true;
+    }
+
+    // at least n bytes ahead of p unless the input ends first
+    bool source::fill(size_t n)
+    {
+        while (size_t(end - p) < n && !eof)
+        {
+            size_t keep = end - p;
+            buf.erase(0, p - buf.data());
+            buf.resize(keep + BULK_READ_SIZE);
+            ssize_t got = read(fd, &buf[keep], BULK_READ_SIZE);
+            got = got > 0? got: 0;
+            eof = !got;
+            buf.resize(keep + got);
+            p = buf.data();
+            end = p + buf.size();
+        }
+        return size_t(end - p) >= n;
+    }
+
+    // to the next record, over blank lines
+    bool source::skip_space(void)
+    {
+        while (fill(1))
+        {
+            if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            {
+                return true;
+            }
+            ++p;
+        }
+        return false;
+    }
+
+    // within a line
+    void source::skip_blank(void)
+    {
+        while (fill(1) && (*p == ' ' || *p == '\t' || *p == '\r'))
+        {
+            ++p;
+        }
+    }
+
+    // past the end of the current line
+    void source::skip_line(void)
+    {
+        while (fill(1) && *p++ != '\n')
+        {
+        }
+    }
+
+    // an optionally signed decimal on the current line; the input is
+    // not NUL terminated
+    bool source::read_int(long &v)
+    {
+        skip_blank();
+        if (!fill(1))
+        {
+            return false;
+        }
+        bool neg = *p == '-';
+        p += neg;
+        if (!fill(1) || *p < '0' || *p > '9')
+        {
+            return false;
+        }
+        v = 0;
+        while (fill(1) && *p >= '0' && *p <= '9')
+        {
+            // saturates, far out of any valid range
+            v = v < (1L << 40)? v*10 + (*p - '0'): v;
+            ++p;
+        }
+        v = neg? -v: v;
+        return true;
+    }
+
+    bool source::next(position &pos)
+    {
+        if (!skip_space())
+        {
+            return false;
+        }
+        pos.size = 0;
+        pos.error = NULL;
+        pos.frame = (unsigned char)*p == SERVICE_FRAME;
+        if (pos.frame)
+        {
+            if (!fill(SERVICE_FRAME_LEN))
+            {
+                p = end;
+                pos.error = "error truncated frame\n";
+                return true;
+            }
+            const unsigned char *f = (const unsigned char*)p;
+            uint64_t packed = 0;
+            uint32_t score = 0;
+            for (int k = 0; k < 8; ++k)
+            {
+                packed |= uint64_t(f[1 + k]) << (8*k);
+            }
+            for (int k = 0; k < 4; ++k)
+            {
+                score |= uint32_t(f[9 + k]) << (8*k);
+            }
+            // packed as by sym_pack
+            for (int c = 0; c < 16; ++c)
+            {
+                pos.cells[c] = packed >> (60 - 4*c) & 0xf;
+            }
+            pos.size = 4;
+            pos.score = int(score);
+            p += SERVICE_FRAME_LEN;
+            return true;
+        }
+        // one line, checked as the service checks it; whatever goes
+        // wrong, the rest of the line is skipped with it
+        pos.error = "error bad board\n";
+        long size, score, v;
+        if (!read_int(size) || size < 2 || size > SERVICE_MAX_SIZE || !read_int(score))
+        {
+            skip_line();
+            return true;
+        }
+        for (int c = 0; c < size*size; ++c)
+        {
+            if (!read_int(v) || v < 0 || v >= SERVICE_MAX_VAL)
+            {
+                skip_line();
+                return true;
+            }
+            pos.cells[c] = uint8_t(v);
+        }
+        skip_line();
+        pos.error = NULL;
+        pos.size = int(size);
+        pos.score = int(score);
+        return true;
+    }
+
+
+    struct shared
+    {
+        std::mutex lock;
+        std::condition_variable job_ready;
+        std::condition_variable done_ready;
+        std::condition_variable room;
+        std::deque<batch*> jobs;
+        std::vector<batch*> done; // by seq % slots
+        int in_flight;
+        int max_in_flight;
+        bool read_done;
+        long long batch_num;
+
+        // the calling thread's evaluation weights
+        double weights[evaluater::FEATURE_PAD];
+        double svk1;
+        double svk2;
+    };
+
+    void answer(game2048 &game, const position &pos, std::string &out)
+    {
+        std::chrono::steady_clock::time_point start_t = std::chrono::steady_clock::now();
+        game.set_score(pos.score);
+        for (int c = 0; c < pos.size*pos.size; ++c)
+        {
+            game.set(c / pos.size, c % pos.size, pos.cells[c]);
+        }
+        int opt_i = -1;
+        solver::node_count = 0;
+        solver::last_value = 0;
+        if (game.get_move_mask())
+        {
+            opt_i = solver::solve(game);
+        }
+        double us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start_t).count();
+        if (!pos.frame)
+        {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "%d %.4lf %lld %.0lf\n",
+                opt_i, solver::last_value, solver::node_count, us);
+            out += buf;
+            return;
+        }
+        float value = float(solver::last_value);
+        uint32_t nodes = uint32_t(solver::node_count);
+        uint32_t latency = uint32_t(us);
+        unsigned char reply[14];
+        reply[0] = SERVICE_FRAME;
+        reply[1] = (unsigned char)(int8_t(opt_i));
+        memcpy(reply + 2, &value, 4);
+        for (int k = 0; k < 4; ++k)
+        {
+            reply[6 + k] = (unsigned char)(nodes >> (8*k));
+            reply[10 + k] = (unsigned char)(latency >> (8*k));
+        }
+        out.append((const char*)reply, sizeof(reply));
+    }
+
+    void worker(shared *s)
+    {
+        memcpy(evaluater::WEIGHTS, s->weights, sizeof(s->weights));
+        evaluater::SVK1 = s->svk1;
+        evaluater::SVK2 = s->svk2;
+        trans_table table(TT_BITS, false);
+        solver::TABLE = &table;
+        game2048* games[SERVICE_MAX_SIZE + 1] = {};
+        while (true)
+        {
+            batch *b;
+            {
+                std::unique_lock<std::mutex> guard(s->lock);
+                s->job_ready.wait(guard, [s] { return s->read_done || !s->jobs.empty(); });
+                if (s->jobs.empty())
+                {
+                    break;
+                }
+                b = s->jobs.front();
+                s->jobs.pop_front();
+            }
+            for (size_t k = 0; k < b->positions.size(); ++k)
+            {
+                const position &pos = b->positions[k];
+                if (pos.error)
+                {
+                    b->out += pos.error;
+                    continue;
+                }
+                if (!games[pos.size])
+                {
+                    games[pos.size] = new game2048(pos.size);
+                }
+                answer(*games[pos.size], pos, b->out);
+            }
+            std::lock_guard<std::mutex> guard(s->lock);
+            s->done[b->seq % s->max_in_flight] = b;
+            s->done_ready.notify_all();
+        }
+        for (int size = 0; size <= SERVICE_MAX_SIZE; ++size)
+        {
+            delete games[size];
+        }
+    }
+
+    void reader(shared *s, source *in)
+    {
+        long long seq = 0;
+        bool more = true;
+        while (more)
+        {
+            {
+                std::unique_lock<std::mutex> guard(s->lock);
+                s->room.wait(guard, [s] { return s->in_flight < s->max_in_flight; });
+                ++s->in_flight;
+            }
+            batch *b = new batch;
+            b->seq = seq;
+            b->positions.resize(BULK_BATCH);
+            int n = 0;
+            while (n < BULK_BATCH && (more = in->next(b->positions[n])))
+            {
+                ++n;
+            }
+            b->positions.resize(n);
+            std::lock_guard<std::mutex> guard(s->lock);
+            if (!n)
+            {
+                --s->in_flight;
+                delete b;
+                break;
+            }
+            ++seq;
+            s->jobs.push_back(b);
+            s->job_ready.notify_one();
+        }
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->batch_num = seq;
+        s->read_done = true;
+        s->job_ready.notify_all();
+        s->done_ready.notify_all();
+    }
+
+    // returns the number of positions read, -1 if a file cannot be opened
+    long long run(const char *in_name, const char *out_name="-", int thread_num=0)
+    {
+        source in;
+        if (!in.open(in_name))
+        {
+            perror(in_name);
+            return -1;
+        }
+        FILE *out = strcmp(out_name, "-")? fopen(out_name, "wb"): stdout;
+        if (!out)
+        {
+            perror(out_name);
+            return -1;
+        }
+        static char out_buffer[BULK_OUT_BUFFER];
+        setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+        if (thread_num <= 0)
+        {
+            thread_num = std::thread::hardware_concurrency();
+            thread_num = thread_num > 0? thread_num: 1;
+        }
+        // the Monte Carlo engine runs its own threads on shared state
+        if (solver::ENGINE != solver::ENGINE_MINIMAX)
+        {
+            thread_num = 1;
+        }
+        shared s;
+        memcpy(s.weights, evaluater::WEIGHTS, sizeof(s.weights));
+        s.svk1 = evaluater::SVK1;
+        s.svk2 = evaluater::SVK2;
+        s.in_flight = 0;
+        s.max_in_flight = thread_num*BULK_IN_FLIGHT;
+        s.done.assign(s.max_in_flight, NULL);
+        s.read_done = false;
+        s.batch_num = -1;
+
+        std::thread read_thread(reader, &s, &in);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers.push_back(std::thread(worker, &s));
+        }
+        long long count = 0;
+        for (long long seq = 0; ; ++seq)
+        {
+            batch *b;
+            {
+                std::unique_lock<std::mutex> guard(s.lock);
+                int slot = seq % s.max_in_flight;
+                s.done_ready.wait(guard, [&s, seq, slot] {
+                    return s.done[slot] || (s.read_done && seq >= s.batch_num); });
+                b = s.done[slot];
+                if (!b)
+                {
+                    break;
+                }
+                s.done[slot] = NULL;
+            }
+            fwrite(b->out.data(), 1, b->out.size(), out);
+            count += b->positions.size();
+            delete b;
+            std::lock_guard<std::mutex> guard(s.lock);
+            --s.in_flight;
+            s.room.notify_one();
+        }
+        read_thread.join();
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers[t].join();
+        }
+        fflush(out);
+        if (out != stdout)
+        {
+            fclose(out);
+        }
+        return count;
+    }
+}
+
+
+
+#endif
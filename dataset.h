@@ -0,0 +1,617 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "game2048.h"
+#include "symmetry.h"
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// Self-play training samples: the board before a move, packed as by
+// sym_pack, the score, the search value, the move, and the final score
+// and largest tile of the game it came from.
+//
+// File: DS_MAGIC, version, chunks, the chunk index, then a trailer
+// (index offset, chunk count, DS_INDEX_MAGIC) in the last 16 bytes.
+// A chunk holds whole games, bit-packed: per game the sample count,
+// final score and max tile, then per sample
+//     changed-cell mask (16 bits) and the new cells (4 bits each),
+//     move (2 bits),
+//     score gain since the last sample (Elias gamma),
+//     value XORed with the last one (Gorilla style: 0, or leading
+//     zeros, length and the meaningful bits).
+// Chunks decode on their own, so readers can split them over threads.
+
+const char DS_MAGIC[4] = {'D', 'S', 'E', 'T'};
+const char DS_INDEX_MAGIC[4] = {'D', 'S', 'I', 'X'};
+const uint32_t DS_VERSION = 1;
+const int DS_CHUNK_SAMPLES = 1 << 16; // a chunk is closed past this
+
+
+struct ds_sample
+{
+    uint64_t board;
+    uint32_t score;
+    float value;
+    int8_t move;
+    uint8_t max_val; // of the game
+    uint32_t final_score; // of the game
+};
+
+struct ds_header
+{
+    char magic[4];
+    uint32_t version;
+};
+
+struct ds_chunk_info
+{
+    uint64_t offset;
+    uint32_t bytes;
+    uint32_t games;
+    uint32_t samples;
+    uint32_t reserved;
+};
+
+struct ds_trailer
+{
+    uint64_t index_offset;
+    uint32_t chunk_num;
+    char magic[4];
+};
+
+
+// appends bits LSB first
+class ds_bit_writer
+{
+public:
+    ds_bit_writer(): acc(0), fill(0) {}
+
+    inline void put(uint64_t x, int n)
+    {
+        // n <= 32 per call
+        acc |= (x & ((uint64_t(1) << n) - 1)) << fill;
+        fill += n;
+        while (fill >= 8)
+        {
+            out.push_back(char(acc));
+            acc >>= 8;
+            fill -= 8;
+        }
+    }
+
+    // x >= 1: n zeros, a one, then the n bits below the leading one
+    inline void gamma(uint64_t x)
+    {
+        int n = 63 - __builtin_clzll(x);
+        for (int k = n; k > 0; k -= 32)
+        {
+            put(0, k >= 32? 32: k);
+        }
+        put(1, 1);
+        for (int k = n; k > 0; )
+        {
+            int m = k >= 32? 32: k;
+            put(x >> (k - m), m);
+            k -= m;
+        }
+    }
+
+    inline void align(void)
+    {
+        if (fill)
+        {
+            put(0, 8 - fill);
+        }
+    }
+
+    std::string out;
+
+private:
+    uint64_t acc;
+    int fill;
+};
+
+class ds_bit_reader
+{
+public:
+    ds_bit_reader(const unsigned char *_p, size_t n): p(_p), end(_p + n), acc(0), fill(0), over(false) {}
+
+    inline uint64_t get(int n)
+    {
+        // n <= 32 per call; zeros past the end
+        while (fill < n)
+        {
+            over |= p >= end;
+            acc |= uint64_t(p < end? *p++: 0) << fill;
+            fill += 8;
+        }
+        uint64_t x = acc & ((uint64_t(1) << n) - 1);
+        acc >>= n;
+        fill -= n;
+        return x;
+    }
+
+    inline uint64_t gamma(void)
+    {
+        int n = 0;
+        while (!get(1))
+        {
+            if (++n > 63)
+            {
+                return 0;
+            }
+        }
+        uint64_t x = 1;
+        for (int k = n; k > 0; )
+        {
+            int m = k >= 32? 32: k;
+            x = x << m | get(m);
+            k -= m;
+        }
+        return x;
+    }
+
+    // bits past the end were asked for
+    inline bool overrun(void) const
+    {
+        return over;
+    }
+
+private:
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t acc;
+    int fill;
+    bool over;
+};
+
+
+// Encodes and writes on its own thread; add_game() only queues.
+class dataset_writer
+{
+public:
+    dataset_writer();
+    ~dataset_writer();
+
+    bool open(const char *filename, int _chunk_samples=DS_CHUNK_SAMPLES);
+    // takes the samples of a finished game, leaving the vector empty;
+    // their outcome fields are set here
+    void add_game(std::vector<ds_sample> &samples, int final_score, int max_val);
+    // writes what is queued, the index and the trailer
+    bool close(void);
+
+    // once closed
+    inline long long get_sample_num(void) const;
+
+private:
+    struct game
+    {
+        std::vector<ds_sample> samples;
+    };
+
+    FILE *file;
+    int chunk_samples;
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<game*> queue;
+    bool closing;
+    bool failed;
+
+    ds_bit_writer chunk;
+    ds_chunk_info info;
+    uint64_t offset;
+    std::vector<ds_chunk_info> index;
+    long long sample_num;
+
+    void loop(void);
+    void encode(const game &g);
+    void flush_chunk(void);
+};
+
+
+// Maps a dataset read-only; read_chunk() is safe from many threads.
+class dataset_reader
+{
+public:
+    dataset_reader();
+    ~dataset_reader();
+
+    bool open(const char *filename);
+    void close(void);
+
+    inline int get_chunk_num(void) const;
+    inline long long get_sample_num(void) const;
+    // appends chunk c's samples to out
+    bool read_chunk(int c, std::vector<ds_sample> &out) const;
+
+private:
+    const unsigned char *data;
+    size_t size;
+    // copied out, the file keeps it unaligned
+    std::vector<ds_chunk_info> index;
+    int chunk_num;
+    long long sample_num;
+};
+
+
+// the board as a sample of the game so far; false for boards the
+// format cannot hold (not 4x4, or a tile above 2^15)
+inline bool ds_record(std::vector<ds_sample> &samples, const game2048 &node, int move, double value)
+{
+    ds_sample s;
+    if (!sym_pack(node, s.board))
+    {
+        return false;
+    }
+    s.score = node.get_score();
+    s.value = float(value);
+    s.move = int8_t(move);
+    s.max_val = 0;
+    s.final_score = 0;
+    samples.push_back(s);
+    return true;
+}
+
+
+dataset_writer::dataset_writer()
+{
+    file = NULL;
+    chunk_samples = DS_CHUNK_SAMPLES;
+    closing = false;
+    failed = false;
+    offset = 0;
+    sample_num = 0;
+}
+
+dataset_writer::~dataset_writer()
+{
+    close();
+}
+
+
+bool dataset_writer::open(const char *filename, int _chunk_samples /*=DS_CHUNK_SAMPLES*/)
+{
+    close();
+    file = fopen(filename, "wb");
+    if (!file)
+    {
+        return false;
+    }
+    chunk_samples = _chunk_samples > 0? _chunk_samples: DS_CHUNK_SAMPLES;
+    ds_header h;
+    memcpy(h.magic, DS_MAGIC, 4);
+    h.version = DS_VERSION;
+    failed = fwrite(&h, sizeof(h), 1, file) != 1;
+    offset = sizeof(h);
+    index.clear();
+    memset(&info, 0, sizeof(info));
+    chunk.out.clear();
+    sample_num = 0;
+    closing = false;
+    worker = std::thread(&dataset_writer::loop, this);
+    return true;
+}
+
+
+void dataset_writer::add_game(std::vector<ds_sample> &samples, int final_score, int max_val)
+{
+    if (samples.empty())
+    {
+        return;
+    }
+    for (size_t k = 0; k < samples.size(); ++k)
+    {
+        samples[k].final_score = uint32_t(final_score);
+        samples[k].max_val = uint8_t(max_val);
+    }
+    game *g = new game;
+    g->samples.swap(samples);
+    std::lock_guard<std::mutex> guard(lock);
+    queue.push_back(g);
+    ready.notify_one();
+}
+
+
+bool dataset_writer::close(void)
+{
+    if (!file)
+    {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+        ready.notify_one();
+    }
+    worker.join();
+    flush_chunk();
+    ds_trailer t;
+    t.index_offset = offset;
+    t.chunk_num = uint32_t(index.size());
+    memcpy(t.magic, DS_INDEX_MAGIC, 4);
+    if (!index.empty() && fwrite(index.data(), sizeof(ds_chunk_info), index.size(), file) != index.size())
+    {
+        failed = true;
+    }
+    failed |= fwrite(&t, sizeof(t), 1, file) != 1;
+    failed |= fclose(file) != 0;
+    file = NULL;
+    return !failed;
+}
+
+
+inline long long dataset_writer::get_sample_num(void) const
+{
+    return sample_num;
+}
+
+
+void dataset_writer::loop(void)
+{
+    while (true)
+    {
+        game *g;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [this] { return closing || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            g = queue.front();
+            queue.pop_front();
+        }
+        encode(*g);
+        delete g;
+        if (int(info.samples) >= chunk_samples)
+        {
+            flush_chunk();
+        }
+    }
+}
+
+
+void dataset_writer::encode(const game &g)
+{
+    const std::vector<ds_sample> &s = g.samples;
+    chunk.gamma(s.size());
+    chunk.gamma(uint64_t(s[0].final_score) + 1);
+    chunk.put(s[0].max_val, 5);
+    uint64_t board = 0;
+    uint32_t score = 0;
+    uint32_t value = 0;
+    for (size_t k = 0; k < s.size(); ++k)
+    {
+        uint64_t x = s[k].board ^ board;
+        int mask = 0;
+        for (int c = 0; c < 16; ++c)
+        {
+            mask |= (x >> (4*c) & 0xf) != 0? 1 << c: 0;
+        }
+        chunk.put(mask, 16);
+        for (int c = 0; c < 16; ++c)
+        {
+            if (mask >> c & 1)
+            {
+                chunk.put(s[k].board >> (4*c), 4);
+            }
+        }
+        chunk.put(s[k].move, 2);
+        // scores only grow within a game
+        chunk.gamma(uint64_t(s[k].score - score) + 1);
+        uint32_t v;
+        memcpy(&v, &s[k].value, 4);
+        uint32_t vx = v ^ value;
+        chunk.put(vx != 0, 1);
+        if (vx)
+        {
+            int lead = __builtin_clz(vx);
+            int trail = __builtin_ctz(vx);
+            int len = 32 - lead - trail;
+            chunk.put(lead, 5);
+            chunk.put(len - 1, 5);
+            chunk.put(vx >> trail, len);
+        }
+        board = s[k].board;
+        score = s[k].score;
+        value = v;
+    }
+    ++info.games;
+    info.samples += s.size();
+    sample_num += s.size();
+}
+
+
+void dataset_writer::flush_chunk(void)
+{
+    if (!info.samples)
+    {
+        return;
+    }
+    chunk.align();
+    info.offset = offset;
+    info.bytes = uint32_t(chunk.out.size());
+    failed |= fwrite(chunk.out.data(), 1, chunk.out.size(), file) != chunk.out.size();
+    offset += chunk.out.size();
+    index.push_back(info);
+    memset(&info, 0, sizeof(info));
+    chunk = ds_bit_writer();
+}
+
+
+dataset_reader::dataset_reader()
+{
+    data = NULL;
+    size = 0;
+    chunk_num = 0;
+    sample_num = 0;
+}
+
+dataset_reader::~dataset_reader()
+{
+    close();
+}
+
+
+bool dataset_reader::open(const char *filename)
+{
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || size_t(st.st_size) < sizeof(ds_header) + sizeof(ds_trailer))
+    {
+        ::close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+    data = (const unsigned char*)p;
+    size = st.st_size;
+    const ds_header *h = (const ds_header*)data;
+    ds_trailer t;
+    memcpy(&t, data + size - sizeof(t), sizeof(t));
+    if (memcmp(h->magic, DS_MAGIC, 4) || h->version != DS_VERSION ||
+        memcmp(t.magic, DS_INDEX_MAGIC, 4) ||
+        t.index_offset + uint64_t(t.chunk_num)*sizeof(ds_chunk_info) + sizeof(t) != size)
+    {
+        close();
+        return false;
+    }
+    chunk_num = t.chunk_num;
+    index.resize(chunk_num);
+    if (chunk_num)
+    {
+        memcpy(index.data(), data + t.index_offset, sizeof(ds_chunk_info)*chunk_num);
+    }
+    for (int c = 0; c < chunk_num; ++c)
+    {
+        if (index[c].offset + index[c].bytes > t.index_offset)
+        {
+            close();
+            return false;
+        }
+        sample_num += index[c].samples;
+    }
+    return true;
+}
+
+void dataset_reader::close(void)
+{
+    if (data)
+    {
+        munmap((void*)data, size);
+    }
+    data = NULL;
+    size = 0;
+    index.clear();
+    chunk_num = 0;
+    sample_num = 0;
+}
+
+
+inline int dataset_reader::get_chunk_num(void) const
+{
+    return chunk_num;
+}
+
+inline long long dataset_reader::get_sample_num(void) const
+{
+    return sample_num;
+}
+
+
+// false, with out as it was, for a chunk that does not decode to the
+// games and samples its index entry gives
+bool dataset_reader::read_chunk(int c, std::vector<ds_sample> &out) const
+{
+    if (c < 0 || c >= chunk_num)
+    {
+        return false;
+    }
+    const ds_chunk_info &info = index[c];
+    ds_bit_reader in(data + info.offset, info.bytes);
+    size_t first = out.size();
+    uint64_t total = 0;
+    for (uint32_t game_i = 0; game_i < info.games; ++game_i)
+    {
+        uint64_t n = in.gamma();
+        total += n;
+        if (!n || total > info.samples)
+        {
+            out.resize(first);
+            return false;
+        }
+        uint32_t final_score = uint32_t(in.gamma() - 1);
+        uint8_t max_val = uint8_t(in.get(5));
+        uint64_t board = 0;
+        uint32_t score = 0;
+        uint32_t value = 0;
+        for (uint64_t k = 0; k < n; ++k)
+        {
+            int mask = int(in.get(16));
+            for (int cell = 0; cell < 16; ++cell)
+            {
+                if (mask >> cell & 1)
+                {
+                    board = (board & ~(uint64_t(0xf) << (4*cell))) | in.get(4) << (4*cell);
+                }
+            }
+            ds_sample s;
+            s.board = board;
+            s.move = int8_t(in.get(2));
+            score += uint32_t(in.gamma() - 1);
+            s.score = score;
+            if (in.get(1))
+            {
+                int lead = int(in.get(5));
+                int len = int(in.get(5)) + 1;
+                if (lead + len > 32)
+                {
+                    out.resize(first);
+                    return false;
+                }
+                value ^= uint32_t(in.get(len)) << (32 - lead - len);
+            }
+            memcpy(&s.value, &value, 4);
+            s.max_val = max_val;
+            s.final_score = final_score;
+            if (in.overrun())
+            {
+                out.resize(first);
+                return false;
+            }
+            out.push_back(s);
+        }
+    }
+    if (total != info.samples)
+    {
+        out.resize(first);
+        return false;
+    }
+    return true;
+}
+
+
+
+#endif
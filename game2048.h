@@ -6,6 +6,7 @@
 #include <ctime>
 #include <iostream>
 #include <fstream>
+#include <cstdint>
 
 
 const int DEFAULT_SIZE = 4;
@@ -13,19 +14,108 @@ const int DEFAULT_SIZE = 4;
 // cmd output
 const int OUTPUT_INT_WIDE = 5;
 
-// cmd game
-const bool GAME_CLS = true;
-
-
 const bool LOG_DECODE = true;
 const bool LOG_RAW = false;
 
 
+// ANSI colour of a tile by exponent
+inline const char* tile_color(int v)
+{
+    if (v <= 4)
+        return "\x1b[37m";
+    else if (v <= 8)
+        return "\x1b[36m";
+    else if (v == 9)
+        return "\x1b[35m";
+    else if (v == 10)
+        return "\x1b[34m";
+    return "\x1b[31m";
+}
+
+
+inline uint32_t xorshift32(uint32_t &x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+
+// evaluation features of a board, summed over its lines.
+// Smoothness parts for direction k (neighbour at (i, j) + step k, with
+// steps right, left, down, up) count the pairs where the tile is larger
+// than its neighbour (diff: total exponent gap towards a tile, zero:
+// towards an empty cell) and where it is one below it (step).
+// Monotonicity per line is the smaller of its total exponent rise and
+// fall, empty cells counting as 0; mono sums it over rows, then columns.
+struct board_features
+{
+    int empty_num;
+    int max_val;
+    int diff[4];
+    int zero[4];
+    int step[4];
+    int merge; // pairs of equal tiles next to each other
+    int mono[2];
+};
+
+struct line_features
+{
+    int empty_num;
+    int max_val;
+    int diff[2];
+    int zero[2];
+    int step[2];
+    int merge;
+    int mono;
+};
+
+
+// Lines of ROW_LEN cells with exponents below ROW_VALUES have a 16-bit
+// key, cell k in bits 4k..4k+3. ROW_TABLE, when loaded (rowtable.h),
+// holds per key the line after a move towards cell 0 and its features,
+// and 4x4 boards then move and update features by lookup.
+const int ROW_LEN = 4;
+const int ROW_VALUES = 16;
+const int ROW_NUM = 1 << (4*ROW_LEN);
+const uint8_t ROW_OVERFLOW = 1; // a merge makes 2^ROW_VALUES
+
+struct row_entry
+{
+    uint16_t moved;
+    uint32_t gain;
+    int8_t empty_num;
+    int8_t max_val;
+    int8_t diff[2];
+    int8_t zero[2];
+    int8_t step[2];
+    int8_t merge;
+    int8_t mono;
+    uint8_t flags;
+};
+
+const row_entry *ROW_TABLE = NULL;
+
+
+// what apply() and spawn() need to restore the board exactly
+const int UNDO_MAX_CELLS = 64; // boards up to 8x8
+
+struct undo_token
+{
+    int gain; // score of the move, -1 if it changed nothing
+    int score;
+    int cell; // spawned cell, -1 for a move
+    uint8_t cells[UNDO_MAX_CELLS]; // board before the move
+};
+
+
 class game2048
 {
 public:
     void init(int _size);
     game2048();
+    game2048(int _size);
     game2048(const game2048 &game);
     ~game2048();
 
@@ -36,6 +126,7 @@ public:
 
     int get_max_val(void) const;
     int get_empty_num(void) const;
+    const board_features& get_features(void) const;
 
     int opt_u(void);
     int opt_d(void);
@@ -44,10 +135,19 @@ public:
     inline int opt(int opt_i);
 
     inline void set(int i, int j, int v);
+    inline void set_score(int _score);
+
+    // apply() needs a board of at most UNDO_MAX_CELLS cells
+    inline bool undoable(void) const;
+    inline undo_token apply(int opt_i);
+    inline undo_token spawn(int i, int j, int v);
+    inline void undo(const undo_token &token);
 
     void clear_board(void);
     void generate_new(void);
+    void generate_new(uint32_t &seed);
 
+    int get_move_mask(void) const;
     bool is_dead(void) const;
     inline bool in_board(int i, int j) const;
 
@@ -56,6 +156,7 @@ public:
     void log_to_file(const char *filename) const;
     void log_to_cmd(bool log_type=LOG_DECODE) const;
 
+    // interactive play on a renderer, defined in renderer.h
     void cmd_game(void);
 
 private:
@@ -63,7 +164,28 @@ private:
     int score;
     int** board;
 
+    // features are kept per row (horizontal parts, empties, max) and per
+    // column (vertical parts); changed cells mark their row and column,
+    // and only marked lines are recomputed when features are read;
+    // lines from DIRTY_TOP on share the top bit
+    mutable line_features* lines; // [0, size) rows, [size, 2*size) columns
+    mutable board_features features;
+    mutable uint64_t dirty_rows;
+    mutable uint64_t dirty_cols;
+    static const int DIRTY_TOP = 63;
+
+    static inline uint64_t line_bit(int i);
+
     int merge(int a, int b, int x, int y);
+    inline bool opt_rows(int opt_i, int &gain);
+    inline void touch(int i, int j);
+    inline void touch_all(void);
+    void line_update(line_features &f, int i, int j, int di, int dj) const;
+    void refresh_features(void) const;
+
+public:
+    static void line_scan(const int *const *cells, int i, int j, int di, int dj, int n,
+        line_features &f);
 };
 
 
@@ -80,6 +202,25 @@ void game2048::init(int _size)
             board[i][j] = 0;
         }
     }
+    lines = new line_features [2*size];
+    for (int k = 0; k < 2*size; ++k)
+    {
+        line_features &f = lines[k];
+        f.empty_num = 0;
+        f.max_val = 0;
+        f.diff[0] = f.diff[1] = f.zero[0] = f.zero[1] = f.step[0] = f.step[1] = 0;
+        f.merge = 0;
+        f.mono = 0;
+    }
+    features.empty_num = 0;
+    features.max_val = 0;
+    features.merge = 0;
+    features.mono[0] = features.mono[1] = 0;
+    for (int k = 0; k < 4; ++k)
+    {
+        features.diff[k] = features.zero[k] = features.step[k] = 0;
+    }
+    touch_all();
 }
 
 game2048::game2048()
@@ -87,11 +228,15 @@ game2048::game2048()
     init(DEFAULT_SIZE);
 }
 
+game2048::game2048(int _size)
+{
+    init(_size);
+}
+
 game2048::game2048(const game2048 &game)
 {
-    size = game.size;
+    init(game.size);
     score = game.score;
-    init(size);
     for (int i = 0; i < size; ++i)
     {
         for (int j = 0; j < size; ++j)
@@ -99,6 +244,13 @@ game2048::game2048(const game2048 &game)
             board[i][j] = game.get(i, j);
         }
     }
+    for (int k = 0; k < 2*size; ++k)
+    {
+        lines[k] = game.lines[k];
+    }
+    features = game.features;
+    dirty_rows = game.dirty_rows;
+    dirty_cols = game.dirty_cols;
 }
 
 game2048::~game2048()
@@ -108,6 +260,7 @@ game2048::~game2048()
         delete []board[i];
     }
     delete []board;
+    delete []lines;
 }
 
 
@@ -134,34 +287,186 @@ inline int** game2048::get_board(void) const
 
 int game2048::get_max_val(void) const
 {
-    int max_val = 0;
-    for (int i = 0; i < size; ++i)
+    return get_features().max_val;
+}
+
+int game2048::get_empty_num(void) const 
+{
+    return get_features().empty_num;
+}
+
+const board_features& game2048::get_features(void) const
+{
+    if (dirty_rows | dirty_cols)
     {
-        for (int j = 0; j < size; ++j)
+        refresh_features();
+    }
+    return features;
+}
+
+
+inline uint64_t game2048::line_bit(int i)
+{
+    return uint64_t(1) << (i < DIRTY_TOP? i: DIRTY_TOP);
+}
+
+inline void game2048::touch(int i, int j)
+{
+    dirty_rows |= line_bit(i);
+    dirty_cols |= line_bit(j);
+}
+
+inline void game2048::touch_all(void)
+{
+    dirty_rows = size < 64? (uint64_t(1) << size) - 1: ~uint64_t(0);
+    dirty_cols = dirty_rows;
+}
+
+void game2048::line_update(line_features &f, int i, int j, int di, int dj) const
+{
+    if (ROW_TABLE && size == ROW_LEN)
+    {
+        int key = 0;
+        int top = 0;
+        for (int k = 0; k < ROW_LEN; ++k)
+        {
+            int v = board[i + k*di][j + k*dj];
+            top |= v;
+            key |= v << (4*k);
+        }
+        if (top < ROW_VALUES)
         {
-            if (board[i][j] > max_val)
+            const row_entry &e = ROW_TABLE[key];
+            f.empty_num = e.empty_num;
+            f.max_val = e.max_val;
+            f.merge = e.merge;
+            f.mono = e.mono;
+            for (int k = 0; k < 2; ++k)
             {
-                max_val = board[i][j];
+                f.diff[k] = e.diff[k];
+                f.zero[k] = e.zero[k];
+                f.step[k] = e.step[k];
             }
+            return;
         }
     }
-    return max_val;
+    line_scan(board, i, j, di, dj, size, f);
 }
 
-int game2048::get_empty_num(void) const 
+// features of the n cells starting at (i, j) and walking by (di, dj);
+// part 0 looks at the next cell of the line, part 1 at the previous one
+void game2048::line_scan(const int *const *cells, int i, int j, int di, int dj, int n,
+    line_features &f)
+{
+    f.empty_num = 0;
+    f.max_val = 0;
+    f.diff[0] = f.diff[1] = f.zero[0] = f.zero[1] = f.step[0] = f.step[1] = 0;
+    f.merge = 0;
+    int rise = 0;
+    int fall = 0;
+    int prev = -1;
+    for (int k = 0; k < n; ++k, i += di, j += dj)
+    {
+        int cur = cells[i][j];
+        f.empty_num += !cur;
+        if (cur > f.max_val)
+        {
+            f.max_val = cur;
+        }
+        if (prev < 0)
+        {
+            prev = cur;
+            continue;
+        }
+        f.merge += cur && prev == cur;
+        prev > cur? fall += prev - cur: rise += cur - prev;
+        // (prev, cur) seen from prev, then from cur
+        if (prev > cur)
+        {
+            cur? f.diff[0] += prev - cur: ++f.zero[0];
+        }
+        else if (prev + 1 == cur)
+        {
+            ++f.step[0];
+        }
+        if (cur > prev)
+        {
+            prev? f.diff[1] += cur - prev: ++f.zero[1];
+        }
+        else if (cur + 1 == prev)
+        {
+            ++f.step[1];
+        }
+        prev = cur;
+    }
+    f.mono = rise < fall? rise: fall;
+}
+
+void game2048::refresh_features(void) const
 {
-    int empty_count = 0;
     for (int i = 0; i < size; ++i)
     {
-        for (int j = 0; j < size; ++j)
+        if (dirty_rows & line_bit(i))
         {
-            if (!board[i][j])
+            line_features &f = lines[i];
+            features.empty_num -= f.empty_num;
+            features.merge -= f.merge;
+            features.mono[0] -= f.mono;
+            for (int k = 0; k < 2; ++k)
+            {
+                features.diff[k] -= f.diff[k];
+                features.zero[k] -= f.zero[k];
+                features.step[k] -= f.step[k];
+            }
+            line_update(f, i, 0, 0, 1);
+            features.empty_num += f.empty_num;
+            features.merge += f.merge;
+            features.mono[0] += f.mono;
+            for (int k = 0; k < 2; ++k)
+            {
+                features.diff[k] += f.diff[k];
+                features.zero[k] += f.zero[k];
+                features.step[k] += f.step[k];
+            }
+        }
+    }
+    for (int j = 0; j < size; ++j)
+    {
+        if (dirty_cols & line_bit(j))
+        {
+            line_features &f = lines[size + j];
+            features.merge -= f.merge;
+            features.mono[1] -= f.mono;
+            for (int k = 0; k < 2; ++k)
+            {
+                features.diff[2 + k] -= f.diff[k];
+                features.zero[2 + k] -= f.zero[k];
+                features.step[2 + k] -= f.step[k];
+            }
+            line_update(f, 0, j, 1, 0);
+            features.merge += f.merge;
+            features.mono[1] += f.mono;
+            for (int k = 0; k < 2; ++k)
             {
-                ++empty_count;
+                features.diff[2 + k] += f.diff[k];
+                features.zero[2 + k] += f.zero[k];
+                features.step[2 + k] += f.step[k];
             }
         }
     }
-    return empty_count;
+    if (dirty_rows)
+    {
+        features.max_val = 0;
+        for (int i = 0; i < size; ++i)
+        {
+            if (lines[i].max_val > features.max_val)
+            {
+                features.max_val = lines[i].max_val;
+            }
+        }
+    }
+    dirty_rows = 0;
+    dirty_cols = 0;
 }
 
 
@@ -171,12 +476,16 @@ int game2048::merge(int a, int b, int x, int y)
     // return merge_score / -1 for fail / 0 for moved to empty
     if (!board[x][y])
     {
+        touch(a, b);
+        touch(x, y);
         board[x][y] = board[a][b];
         board[a][b] = 0;
         return 0;
     }
     else if (board[x][y] == board[a][b])
     {
+        touch(a, b);
+        touch(x, y);
         ++board[x][y];
         board[a][b] = 0;
         return 1 << board[x][y];
@@ -212,6 +521,8 @@ int game2048::opt_u(void)
                 board[end][i] = board[j][i];
                 if (end != j)
                 {
+                    touch(end, i);
+                    touch(j, i);
                     board[j][i] = 0;
                     opt_valid = true;
                 }
@@ -255,6 +566,8 @@ int game2048::opt_d(void)
                 board[end][i] = board[j][i];
                 if (end != j)
                 {
+                    touch(end, i);
+                    touch(j, i);
                     board[j][i] = 0;
                     opt_valid = true;
                 }
@@ -300,6 +613,8 @@ int game2048::opt_l(void)
                 board[i][end] = board[i][j];
                 if (end != j)
                 {
+                    touch(i, end);
+                    touch(i, j);
                     board[i][j] = 0;
                     opt_valid = true;
                 }
@@ -345,6 +660,8 @@ int game2048::opt_r(void)
                 board[i][end] = board[i][j];
                 if (end != j)
                 {
+                    touch(i, end);
+                    touch(i, j);
                     board[i][j] = 0;
                     opt_valid = true;
                 }
@@ -364,8 +681,70 @@ int game2048::opt_r(void)
     return -1;
 }
 
+// opt() by ROW_TABLE; false, with the board untouched, when a line
+// has no key or overflows
+inline bool game2048::opt_rows(int opt_i, int &gain)
+{
+    // lines walk from the side moved towards, so they move to cell 0
+    int from[4][2] = {{0, 0}, {0, ROW_LEN - 1}, {ROW_LEN - 1, 0}, {0, 0}};
+    int along[4][2] = {{1, 0}, {0, -1}, {-1, 0}, {0, 1}};
+    int across[4][2] = {{0, 1}, {1, 0}, {0, 1}, {1, 0}};
+    int key[ROW_LEN];
+    for (int l = 0; l < ROW_LEN; ++l)
+    {
+        int i = from[opt_i][0] + l*across[opt_i][0];
+        int j = from[opt_i][1] + l*across[opt_i][1];
+        int top = 0;
+        key[l] = 0;
+        for (int k = 0; k < ROW_LEN; ++k, i += along[opt_i][0], j += along[opt_i][1])
+        {
+            top |= board[i][j];
+            key[l] |= board[i][j] << (4*k);
+        }
+        if (top >= ROW_VALUES || ROW_TABLE[key[l]].flags & ROW_OVERFLOW)
+        {
+            return false;
+        }
+    }
+    gain = 0;
+    bool valid = false;
+    for (int l = 0; l < ROW_LEN; ++l)
+    {
+        const row_entry &e = ROW_TABLE[key[l]];
+        if (e.moved == key[l])
+        {
+            continue;
+        }
+        valid = true;
+        gain += e.gain;
+        int i = from[opt_i][0] + l*across[opt_i][0];
+        int j = from[opt_i][1] + l*across[opt_i][1];
+        for (int k = 0; k < ROW_LEN; ++k, i += along[opt_i][0], j += along[opt_i][1])
+        {
+            int v = e.moved >> (4*k) & 0xf;
+            if (board[i][j] != v)
+            {
+                touch(i, j);
+                board[i][j] = v;
+            }
+        }
+    }
+    if (!valid)
+    {
+        gain = -1;
+        return true;
+    }
+    score += gain;
+    return true;
+}
+
 inline int game2048::opt(int opt_i)
 {
+    int gain;
+    if (ROW_TABLE && size == ROW_LEN && opt_i >= 0 && opt_i < 4 && opt_rows(opt_i, gain))
+    {
+        return gain;
+    }
     if (opt_i == 0 || opt_i == 72 || opt_i == 119 || opt_i == 49)
     {
         return opt_u();
@@ -388,9 +767,79 @@ inline int game2048::opt(int opt_i)
 
 inline void game2048::set(int i, int j, int v)
 {
+    touch(i, j);
     board[i][j] = v;
 }
 
+inline void game2048::set_score(int _score)
+{
+    score = _score;
+}
+
+
+inline bool game2048::undoable(void) const
+{
+    return size*size <= UNDO_MAX_CELLS;
+}
+
+// in-place move / spawn for searches that walk one board down and
+// back up the tree; undo tokens must be undone in reverse order.
+// Searches check undoable() first: a larger board is left as it is.
+inline undo_token game2048::apply(int opt_i)
+{
+    undo_token token;
+    token.score = score;
+    token.cell = -1;
+    token.gain = -1;
+    if (size*size > UNDO_MAX_CELLS)
+    {
+        return token;
+    }
+    for (int i = 0; i < size; ++i)
+    {
+        for (int j = 0; j < size; ++j)
+        {
+            token.cells[i*size + j] = uint8_t(board[i][j]);
+        }
+    }
+    token.gain = opt(opt_i);
+    return token;
+}
+
+inline undo_token game2048::spawn(int i, int j, int v)
+{
+    undo_token token;
+    token.score = score;
+    token.cell = i*size + j;
+    token.gain = 0;
+    set(i, j, v);
+    return token;
+}
+
+inline void game2048::undo(const undo_token &token)
+{
+    score = token.score;
+    if (token.cell >= 0)
+    {
+        set(token.cell / size, token.cell % size, 0);
+        return;
+    }
+    if (token.gain == -1)
+    {
+        return;
+    }
+    for (int i = 0; i < size; ++i)
+    {
+        for (int j = 0; j < size; ++j)
+        {
+            if (board[i][j] != token.cells[i*size + j])
+            {
+                set(i, j, token.cells[i*size + j]);
+            }
+        }
+    }
+}
+
 
 void game2048::clear_board(void)
 {
@@ -402,6 +851,7 @@ void game2048::clear_board(void)
             board[i][j] = 0;
         }
     }
+    touch_all();
 }
 
 void game2048::generate_new(void)
@@ -413,6 +863,7 @@ void game2048::generate_new(void)
         new_x = rand() % size;
         new_y = rand() % size;
     }while(board[new_x][new_y]);
+    touch(new_x, new_y);
     if (rand() % 10)
     {
         board[new_x][new_y] = 1;
@@ -424,24 +875,62 @@ void game2048::generate_new(void)
 }
 
 
-bool game2048::is_dead(void) const
+// draws from the caller's xorshift32 state instead of rand(),
+// so threads and replays get their own spawn sequences
+void game2048::generate_new(uint32_t &seed)
 {
-    for (register int i = 0; i < size; ++i)
+    int empty_num = get_empty_num();
+    if (!empty_num)
     {
-        for (register int j = 0; j < size; ++j)
+        return;
+    }
+    int r = xorshift32(seed) % empty_num;
+    for (int i = 0; i < size; ++i)
+    {
+        for (int j = 0; j < size; ++j)
         {
-            if (!board[i][j] || 
-                (
-                    i != size - 1 && i != size - 1 && 
-                    (board[i][j] == board[i][j + 1] || board[i][j] == board[i + 1][j])
-                )
-            )
+            if (!board[i][j] && !r--)
             {
-                return false;
+                touch(i, j);
+                board[i][j] = xorshift32(seed) % 10? 1: 2;
+                return;
             }
         }
     }
-    return true;
+}
+
+
+// bit opt_i is set when opt(opt_i) would change the board: some tile
+// has an empty cell or an equal tile next to it in that direction
+int game2048::get_move_mask(void) const
+{
+    int up = 0;
+    int right = 0;
+    int down = 0;
+    int left = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        for (int j = 0; j + 1 < size; ++j)
+        {
+            int a = board[i][j];
+            int b = board[i][j + 1];
+            int merge_h = (a != 0) & (a == b);
+            left |= ((a == 0) & (b != 0)) | merge_h;
+            right |= ((a != 0) & (b == 0)) | merge_h;
+            int c = board[j][i];
+            int d = board[j + 1][i];
+            int merge_v = (c != 0) & (c == d);
+            up |= ((c == 0) & (d != 0)) | merge_v;
+            down |= ((c != 0) & (d == 0)) | merge_v;
+        }
+    }
+    return up | right << 1 | down << 2 | left << 3;
+}
+
+bool game2048::is_dead(void) const
+{
+    // an empty board has no move either, but isn't lost
+    return !get_move_mask() && !get_empty_num();
 }
 
 inline bool game2048::in_board(int i, int j) const
@@ -463,6 +952,7 @@ void game2048::load_from_file(const char *filename)
             file >> board[i][j];
         }
     }
+    touch_all();
     file.close();
 }
 
@@ -490,16 +980,7 @@ void game2048::log_to_cmd(bool log_type /* =LOG_DECODE */) const
         {
             if (log_type == LOG_DECODE)
             {
-                if (board[i][j] <= 4)
-                    printf("\x1b[37m%5d\x1b[37m", board[i][j]? 1 << board[i][j]: 0);
-                else if (board[i][j] <= 8)
-                    printf("\x1b[36m%5d\x1b[37m", 1 << board[i][j]);
-                else if (board[i][j] == 9)
-                    printf("\x1b[35m%5d\x1b[37m", 1 << board[i][j]);
-                else if (board[i][j] == 9)
-                    printf("\x1b[34m%5d\x1b[37m", 1 << board[i][j]);
-                else
-                    printf("\x1b[31m%5d\x1b[37m", 1 << board[i][j]);
+                printf("%s%5d\x1b[37m", tile_color(board[i][j]), board[i][j]? 1 << board[i][j]: 0);
             }
             else
             {
@@ -511,33 +992,5 @@ void game2048::log_to_cmd(bool log_type /* =LOG_DECODE */) const
     putchar('\n');
 }
 
-void game2048::cmd_game(void)
-{
-    clear_board();
-    generate_new();
-    char key_down;
-    do
-    {
-        if (GAME_CLS)
-        {
-            system("clear");
-        }
-        generate_new();
-        log_to_cmd(LOG_DECODE);
-        printf("Score: %5d\n", score);
-        do
-        {
-            key_down = getchar();
-            if (key_down == 27 || key_down == 26)
-            {
-                return;
-            }
-        }while (opt(key_down) == -1 && !is_dead());
-    }while(get_empty_num());
-    printf("Good Game.\nFinal Score:%d", score);
-}
-
 
 #endif
-
-
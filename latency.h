@@ -0,0 +1,230 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+
+
+// Log-bucketed latency histogram in nanoseconds: values below
+// 2^LATENCY_SUB_BITS have a bucket each, above that every power of two
+// is split into 2^(LATENCY_SUB_BITS-1) buckets, so a percentile is off
+// by at most 1/32 of its value.
+
+const int LATENCY_SUB_BITS = 6;
+const int LATENCY_MAX_BITS = 47; // ~39 hours
+const int LATENCY_SUB = 1 << LATENCY_SUB_BITS;
+const int LATENCY_HALF = LATENCY_SUB >> 1;
+const int LATENCY_BUCKETS = LATENCY_SUB + (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1)*LATENCY_HALF;
+// empty cell counts kept apart; more empty cells go to the last one
+const int LATENCY_EMPTY_NUM = 17;
+
+
+class latency_hist
+{
+public:
+    latency_hist();
+
+    void clear(void);
+    void record(uint64_t ns);
+    void merge(const latency_hist &h);
+
+    inline uint64_t get_count(void) const;
+    inline uint64_t get_max(void) const;
+    // value at quantile q, rounded up to the top of its bucket
+    uint64_t percentile(double q) const;
+    // count, p50 / p90 / p99 / max in us on one line, no newline
+    void print_line(void) const;
+
+private:
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+
+    static inline int bucket(uint64_t ns);
+    static inline uint64_t bucket_top(int i);
+};
+
+
+// one histogram over all moves and one per empty cell count
+class latency_stats
+{
+public:
+    void clear(void);
+    void record(uint64_t ns, int empty_num);
+    void merge(const latency_stats &s);
+
+    void print(void) const;
+
+    inline const latency_hist& get_all(void) const;
+
+private:
+    latency_hist all;
+    latency_hist by_empty[LATENCY_EMPTY_NUM];
+};
+
+
+inline uint64_t latency_ns(std::chrono::steady_clock::time_point start_t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_t).count();
+}
+
+
+latency_hist::latency_hist()
+{
+    clear();
+}
+
+
+void latency_hist::clear(void)
+{
+    memset(counts, 0, sizeof(counts));
+    count = 0;
+    max = 0;
+}
+
+
+inline int latency_hist::bucket(uint64_t ns)
+{
+    if (ns < uint64_t(LATENCY_SUB))
+    {
+        return int(ns);
+    }
+    int b = 63 - __builtin_clzll(ns);
+    if (b > LATENCY_MAX_BITS)
+    {
+        return LATENCY_BUCKETS - 1;
+    }
+    // top LATENCY_SUB_BITS bits, the leading one included
+    int top = int(ns >> (b - LATENCY_SUB_BITS + 1));
+    return LATENCY_SUB + (b - LATENCY_SUB_BITS)*LATENCY_HALF + top - LATENCY_HALF;
+}
+
+// largest value falling into bucket i
+inline uint64_t latency_hist::bucket_top(int i)
+{
+    if (i < LATENCY_SUB)
+    {
+        return i;
+    }
+    int b = (i - LATENCY_SUB)/LATENCY_HALF + LATENCY_SUB_BITS;
+    uint64_t top = (i - LATENCY_SUB)%LATENCY_HALF + LATENCY_HALF;
+    int shift = b - LATENCY_SUB_BITS + 1;
+    return ((top + 1) << shift) - 1;
+}
+
+
+void latency_hist::record(uint64_t ns)
+{
+    ++counts[bucket(ns)];
+    ++count;
+    max = ns > max? ns: max;
+}
+
+
+void latency_hist::merge(const latency_hist &h)
+{
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        counts[i] += h.counts[i];
+    }
+    count += h.count;
+    max = h.max > max? h.max: max;
+}
+
+
+inline uint64_t latency_hist::get_count(void) const
+{
+    return count;
+}
+
+inline uint64_t latency_hist::get_max(void) const
+{
+    return max;
+}
+
+
+uint64_t latency_hist::percentile(double q) const
+{
+    if (!count)
+    {
+        return 0;
+    }
+    uint64_t rank = uint64_t(q*count + 0.5);
+    rank = rank < 1? 1: rank;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            uint64_t top = bucket_top(i);
+            return top < max? top: max;
+        }
+    }
+    return max;
+}
+
+
+void latency_hist::print_line(void) const
+{
+    printf("%7llu| %9.1lf| %9.1lf| %9.1lf| %9.1lf", (unsigned long long)count,
+        percentile(0.5)/1e3, percentile(0.9)/1e3, percentile(0.99)/1e3, max/1e3);
+}
+
+
+void latency_stats::clear(void)
+{
+    all.clear();
+    for (int e = 0; e < LATENCY_EMPTY_NUM; ++e)
+    {
+        by_empty[e].clear();
+    }
+}
+
+
+void latency_stats::record(uint64_t ns, int empty_num)
+{
+    all.record(ns);
+    by_empty[empty_num < LATENCY_EMPTY_NUM? empty_num: LATENCY_EMPTY_NUM - 1].record(ns);
+}
+
+
+void latency_stats::merge(const latency_stats &s)
+{
+    all.merge(s.all);
+    for (int e = 0; e < LATENCY_EMPTY_NUM; ++e)
+    {
+        by_empty[e].merge(s.by_empty[e]);
+    }
+}
+
+
+inline const latency_hist& latency_stats::get_all(void) const
+{
+    return all;
+}
+
+
+void latency_stats::print(void) const
+{
+    printf("empty|   moves|   p50 us|   p90 us|   p99 us|   max us\n");
+    for (int e = 0; e < LATENCY_EMPTY_NUM; ++e)
+    {
+        if (by_empty[e].get_count())
+        {
+            printf(e < LATENCY_EMPTY_NUM - 1? "%5d| ": "%4d+| ", e);
+            by_empty[e].print_line();
+            putchar('\n');
+        }
+    }
+    printf("  all| ");
+    all.print_line();
+    putchar('\n');
+}
+
+
+
+#endif
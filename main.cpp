@@ -1,9 +1,22 @@
 #include "game2048.h"
 #include "solver.h"
 #include "optimizer.h"
+#include "batch.h"
+#include "service.h"
+#include "ponder.h"
+#include "sprt.h"
+#include "latency.h"
+#include "bulk.h"
+#include "rowtable.h"
+#include "dataset.h"
+#include "renderer.h"
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <thread>
 
 
 namespace test
@@ -13,18 +26,31 @@ namespace test
     const bool PRINT_EVERY_ROUND = true;
     const bool SPLIT_LINE = true;
     const int PRINT_ID_STEP = 5;
+    // pause after each move in test(), pondering meanwhile; 0 for none.
+    // Unpaced games leave no time between moves to ponder in.
+    int PACE_MS = 0;
 
     double mean_s; // score
     double mean_oc; // opt_count
     double mean_mv; // max_val
 
-    clock_t start_t, end_t;
+    // wall clock; clock() counts the CPU time of every thread
+    std::chrono::steady_clock::time_point start_t, end_t;
+    latency_stats latency; // moves of the last test(), by empty cells
 
     void cmd_print_split_line(int line_long);
     inline void test_init(void);
     inline void renew_data(const game2048 &game, int round, int round_i, int opt_count);
     inline void print_final_test_data(int round);
     double test(int round=10);
+    double batch_speed(int games=100000, int policy=BATCH_RANDOM);
+    double chance_agreement(int positions=200, int top_k=6, int min_k=2);
+    double interleave_speed(int positions=1000, int width=solver::INTERLEAVE_WIDTH);
+    double exact_agreement(const retrograde &exact, int games=100);
+    double ponder_latency(int moves=300, int pace_ms=20);
+    double table_probe_speed(int bits=24, long long probes=1 << 24, int thread_num=0);
+    double export_selfplay(const char *filename, int games=100, int thread_num=0);
+    long long dataset_summary(const char *filename, int thread_num=0);
 }
 
 
@@ -44,7 +70,9 @@ inline void test::test_init(void)
     mean_s = 0;
     mean_oc = 0;
     mean_mv = 0;
-    start_t = clock();
+    solver::clear_depth_stats();
+    latency.clear();
+    start_t = std::chrono::steady_clock::now();
 }
 
 
@@ -87,8 +115,13 @@ inline void test::print_final_test_data(int round)
 double test::test(int round /*=10*/)
 {
     char opt_name[4][10] = {"UP", "RIGHT", "DOWN", "LEFT"};
+    char status[RENDER_STATUS_LINES*RENDER_STATUS_LEN];
+    renderer screen;
+    ponderer ponder;
+    std::vector<latency_hist> game_latency(round);
     test_init();
     game2048 game;
+    screen.start();
     for (int round_i = 1; round_i <= round; ++round_i)
     {
         // printf("start test\n");
@@ -96,37 +129,556 @@ double test::test(int round /*=10*/)
         game.generate_new();
         int opt_i;
         int opt_count = 0;
-        clock_t last_t;
+        std::chrono::steady_clock::time_point last_t;
         do
         {
             game.generate_new();
-            last_t = clock();
+            int empty_num = game.get_empty_num();
+            last_t = std::chrono::steady_clock::now();
+            if (PACE_MS)
+            {
+                ponder.hit(game);
+            }
             opt_i = solver::solve(game);
+            ponder.stop();
+            uint64_t ns = latency_ns(last_t);
             game.opt(opt_i);
-
-            system("clear");
+            game_latency[round_i - 1].record(ns);
+            latency.record(ns, empty_num);
 
             ++opt_count;
-            game.log_to_cmd();
-            end_t = clock();
-            printf("opt:  %s\n\n", opt_name[opt_i]);
-            printf("T:    %5.1lf s\n", (double)(end_t - start_t)/CLOCKS_PER_SEC);
-            printf("t:    %5.1lfms\n", (double)(end_t - last_t)/CLOCKS_PER_SEC/opt_count*1000);
-            printf("score:%5d\n", game.get_score());
-            printf("max:  %5d\n", game.get_max_val()? 1 << game.get_max_val(): 0);
+            end_t = std::chrono::steady_clock::now();
+            snprintf(status, sizeof(status), "opt:  %s\ndepth:%5d\nT:    %5.1lf s\nt:    %5.1lfms\nscore:%5d\nmax:  %5d",
+                opt_name[opt_i], solver::last_depth,
+                std::chrono::duration<double>(end_t - start_t).count(),
+                ns/1e6,
+                game.get_score(),
+                game.get_max_val()? 1 << game.get_max_val(): 0);
+            screen.submit(game.get_size(), game.get_board(), status);
+            if (PACE_MS)
+            {
+                // stopped by the hit() on the next board
+                ponder.start(game);
+                std::this_thread::sleep_for(std::chrono::milliseconds(PACE_MS));
+            }
 
         }while (game.get_empty_num());
+        ponder.stop();
         // renew_data(game, round, round_i, opt_count);
         // game.log_to_cmd();
     }
+    screen.stop();
+    printf(" game|   moves|   p50 us|   p90 us|   p99 us|   max us\n");
+    for (int round_i = 1; round_i <= round; ++round_i)
+    {
+        printf("%5d| ", round_i);
+        game_latency[round_i - 1].print_line();
+        putchar('\n');
+    }
+    latency.print();
+    solver::print_depth_stats();
     // print_final_test_data(round);
     return mean_s;
 }
 
 
-int main()
+double test::batch_speed(int games /*=100000*/, int policy /*=BATCH_RANDOM*/)
+{
+    // moves per second of the batch simulator, games from an empty board
+    batch2048 batch(1024, time(0));
+    game2048 empty;
+    batch.set_start(empty, 2);
+    batch.set_policy(policy);
+    clock_t last_t = clock();
+    batch.start(games);
+    batch.run();
+    double total_time = (double)(clock() - last_t)/CLOCKS_PER_SEC;
+    double sum_s = 0;
+    for (size_t i = 0; i < batch.results.size(); ++i)
+    {
+        sum_s += batch.results[i].score;
+    }
+    printf("games:%8d\n", games);
+    printf("score:%8.1lf\n", sum_s/games);
+    printf("MPS:  %8.0lf\n", batch.move_count/total_time);
+    return batch.move_count/total_time;
+}
+
+
+double test::chance_agreement(int positions /*=200*/, int top_k /*=6*/, int min_k /*=2*/)
+{
+    // positions from one full-width game; both searches start from an
+    // empty table so neither profits from the other's results
+    game2048 game;
+    game.clear_board();
+    game.generate_new();
+    int agree = 0;
+    long long full_nodes = 0;
+    long long sel_nodes = 0;
+    double full_t = 0;
+    double sel_t = 0;
+    int count = 0;
+    for (; count < positions; ++count)
+    {
+        game.generate_new();
+        if (game.is_dead())
+        {
+            game.clear_board();
+            game.generate_new();
+            game.generate_new();
+        }
+        solver::set_selective(false);
+        solver::table.clear();
+        clock_t last_t = clock();
+        int full_opt = solver::solve(game);
+        full_nodes += solver::node_count;
+        full_t += (double)(clock() - last_t)/CLOCKS_PER_SEC;
+
+        solver::set_selective(true, top_k, min_k);
+        solver::table.clear();
+        last_t = clock();
+        int sel_opt = solver::solve(game);
+        sel_nodes += solver::node_count;
+        sel_t += (double)(clock() - last_t)/CLOCKS_PER_SEC;
+
+        agree += full_opt == sel_opt;
+        game.opt(full_opt);
+    }
+    solver::set_selective(false);
+    solver::table.clear();
+    printf("top_k:%3d min_k:%3d\n", top_k, min_k);
+    printf("agree:%6.1lf%%\n", 100.0*agree/count);
+    printf("nodes:%6.1lf%%\n", 100.0*sel_nodes/full_nodes);
+    printf("time: %6.1lf%%\n", 100.0*sel_t/full_t);
+    return double(agree)/count;
+}
+
+
+double test::interleave_speed(int positions /*=1000*/, int width /*=INTERLEAVE_WIDTH*/)
+{
+    // positions from self-play, solved one by one and then interleaved,
+    // each run starting from an empty table
+    std::vector<game2048*> games;
+    game2048 game;
+    game.clear_board();
+    game.generate_new();
+    while (int(games.size()) < positions)
+    {
+        game.generate_new();
+        if (game.is_dead())
+        {
+            game.clear_board();
+            game.generate_new();
+            continue;
+        }
+        games.push_back(new game2048(game));
+        game.opt(solver::solve(game));
+    }
+    std::vector<int> seq_moves(positions);
+    std::vector<int> moves(positions);
+
+    solver::table.clear();
+    std::chrono::steady_clock::time_point last_t = std::chrono::steady_clock::now();
+    long long seq_nodes = 0;
+    for (int k = 0; k < positions; ++k)
+    {
+        seq_moves[k] = solver::solve(*games[k]);
+        seq_nodes += solver::node_count;
+    }
+    double seq_t = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_t).count();
+
+    solver::table.clear();
+    last_t = std::chrono::steady_clock::now();
+    solver::solve_batch(games.data(), positions, moves.data(), NULL, width);
+    double inter_t = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_t).count();
+
+    int agree = 0;
+    for (int k = 0; k < positions; ++k)
+    {
+        agree += moves[k] == seq_moves[k];
+        delete games[k];
+    }
+    solver::table.clear();
+    printf("width:     %8d\n", width);
+    printf("sequential:%8.1lf pos/s %8.0lf nodes/s\n", positions/seq_t, seq_nodes/seq_t);
+    printf("interleave:%8.1lf pos/s %8.0lf nodes/s\n", positions/inter_t, solver::node_count/inter_t);
+    printf("speedup:   %8.2lf\n", seq_t/inter_t);
+    printf("agree:     %7.1lf%%\n", 100.0*agree/positions);
+    return seq_t/inter_t;
+}
+
+
+double test::exact_agreement(const retrograde &exact, int games /*=100*/)
+{
+    // heuristic moves on games of the table's size against the optimal
+    // ones; loss is the exact value given up by the heuristic move
+    int size = exact.get_size();
+    game2048 game(size);
+    int agree = 0;
+    int count = 0;
+    double loss = 0;
+    for (int round_i = 0; round_i < games; ++round_i)
+    {
+        game.clear_board();
+        game.generate_new();
+        game.generate_new();
+        while (!game.is_dead())
+        {
+            double best_v;
+            int best = exact.best_move(game, &best_v);
+            int opt_i = solver::solve(game);
+            if (best < 0)
+            {
+                break;
+            }
+            ++count;
+            agree += opt_i == best;
+            loss += best_v - exact.move_value(game, opt_i);
+            game.opt(opt_i);
+            if (!game.get_empty_num())
+            {
+                break;
+            }
+            game.generate_new();
+        }
+    }
+    printf("moves:%8d\n", count);
+    printf("agree:%7.1lf%%\n", 100.0*agree/count);
+    printf("loss: %10.6lf per move\n", loss/count);
+    return double(agree)/count;
+}
+
+
+double test::ponder_latency(int moves /*=300*/, int pace_ms /*=20*/)
+{
+    // the same paced game played twice, from the same rand() seed:
+    // solve() latency without and with pondering during the pause
+    double mean_us[2];
+    unsigned seed = rand();
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        ponderer ponder;
+        srand(seed);
+        solver::table.clear();
+        game2048 game;
+        game.clear_board();
+        game.generate_new();
+        double sum_us = 0;
+        int count = 0;
+        for (; count < moves; ++count)
+        {
+            game.generate_new();
+            if (game.is_dead())
+            {
+                break;
+            }
+            std::chrono::steady_clock::time_point last_t = std::chrono::steady_clock::now();
+            if (pass)
+            {
+                ponder.hit(game);
+            }
+            game.opt(solver::solve(game));
+            ponder.stop();
+            sum_us += std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - last_t).count();
+            if (pass)
+            {
+                ponder.start(game);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(pace_ms));
+        }
+        ponder.stop();
+        mean_us[pass] = sum_us/count;
+    }
+    solver::table.clear();
+    printf("pace:  %6d ms\n", pace_ms);
+    printf("cold:  %8.1lf us/move\n", mean_us[0]);
+    printf("ponder:%8.1lf us/move\n", mean_us[1]);
+    return mean_us[0]/mean_us[1];
+}
+
+
+double test::table_probe_speed(int bits /*=24*/, long long probes /*=1 << 24*/, int thread_num /*=0*/)
+{
+    // random probes into a filled table on plain pages, then on huge
+    // pages; thread_num threads share each table
+    if (thread_num <= 0)
+    {
+        thread_num = std::thread::hardware_concurrency();
+        thread_num = thread_num > 0? thread_num: 1;
+    }
+    bool saved = tablemem::HUGE_PAGES;
+    double probe_s[2];
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        tablemem::HUGE_PAGES = pass;
+        trans_table table(bits, true);
+        int kind = tablemem::last_kind;
+        uint64_t key = 0x2545f4914f6cdd1dULL;
+        for (long long k = 0; k < (1LL << bits); ++k)
+        {
+            key ^= key << 13;
+            key ^= key >> 7;
+            key ^= key << 17;
+            table.store(key, 1, 0, TT_EXACT, -1);
+        }
+        std::vector<std::thread> workers;
+        std::vector<long long> hits(thread_num);
+        std::chrono::steady_clock::time_point last_t = std::chrono::steady_clock::now();
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers.push_back(std::thread([&table, &hits, probes, thread_num, t](void)
+            {
+                uint64_t key = 0x9e3779b97f4a7c15ULL*(t + 1);
+                tt_entry e;
+                long long hit = 0;
+                for (long long k = 0; k < probes/thread_num; ++k)
+                {
+                    key ^= key << 13;
+                    key ^= key >> 7;
+                    key ^= key << 17;
+                    hit += table.probe(key, e);
+                }
+                hits[t] = hit;
+            }));
+        }
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers[t].join();
+        }
+        probe_s[pass] = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_t).count();
+        char desc[64];
+        tablemem::describe(kind, desc, sizeof(desc));
+        printf("%-18s %6.1lf ns/probe %7.1lf Mprobes/s\n", desc,
+            probe_s[pass]*1e9*thread_num/probes, probes/probe_s[pass]/1e6);
+    }
+    tablemem::HUGE_PAGES = saved;
+    printf("table:   %6lld MB, %d threads\n", (long long)(sizeof(tt_entry) << bits) >> 20, thread_num);
+    printf("speedup: %6.2lf\n", probe_s[0]/probe_s[1]);
+    return probe_s[0]/probe_s[1];
+}
+
+
+double test::export_selfplay(const char *filename, int games /*=100*/, int thread_num /*=0*/)
+{
+    // self-play on thread_num threads, every move recorded; NULL plays
+    // the same games without a writer. Returns moves per second.
+    if (thread_num <= 0)
+    {
+        thread_num = std::thread::hardware_concurrency();
+        thread_num = thread_num > 0? thread_num: 1;
+    }
+    dataset_writer writer;
+    if (filename && !writer.open(filename))
+    {
+        perror(filename);
+        return 0;
+    }
+    std::atomic<int> next(0);
+    std::atomic<long long> moves(0);
+    uint32_t base_seed = uint32_t(time(0));
+    std::vector<std::thread> workers;
+    std::chrono::steady_clock::time_point last_t = std::chrono::steady_clock::now();
+    for (int t = 0; t < thread_num; ++t)
+    {
+        workers.push_back(std::thread([&, filename](void)
+        {
+            trans_table table(TT_BITS, false);
+            solver::TABLE = &table;
+            std::vector<ds_sample> samples;
+            game2048 game;
+            for (int game_i = next++; game_i < games; game_i = next++)
+            {
+                uint32_t seed = (base_seed ^ uint32_t(game_i)*0x9e3779b9u) | 1;
+                game.clear_board();
+                game.generate_new(seed);
+                long long count = 0;
+                do
+                {
+                    game.generate_new(seed);
+                    if (game.is_dead())
+                    {
+                        break;
+                    }
+                    int opt_i = solver::solve(game);
+                    if (filename)
+                    {
+                        ds_record(samples, game, opt_i, solver::last_value);
+                    }
+                    game.opt(opt_i);
+                    ++count;
+                }while (game.get_empty_num());
+                moves += count;
+                if (filename)
+                {
+                    writer.add_game(samples, game.get_score(), game.get_max_val());
+                }
+            }
+        }));
+    }
+    for (int t = 0; t < thread_num; ++t)
+    {
+        workers[t].join();
+    }
+    double play_t = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_t).count();
+    if (filename && !writer.close())
+    {
+        perror(filename);
+    }
+    printf("games:  %8d\n", games);
+    printf("moves:  %8lld\n", moves.load());
+    printf("MPS:    %8.1lf\n", moves/play_t);
+    if (filename)
+    {
+        struct stat st;
+        stat(filename, &st);
+        printf("bytes:  %8.2lf per sample\n", double(st.st_size)/writer.get_sample_num());
+    }
+    return moves/play_t;
+}
+
+
+long long test::dataset_summary(const char *filename, int thread_num /*=0*/)
+{
+    // chunks split over threads as a training reader would
+    dataset_reader reader;
+    if (!reader.open(filename))
+    {
+        fprintf(stderr, "%s: not a dataset\n", filename);
+        return -1;
+    }
+    if (thread_num <= 0)
+    {
+        thread_num = std::thread::hardware_concurrency();
+        thread_num = thread_num > 0? thread_num: 1;
+    }
+    std::vector<long long> samples(thread_num);
+    std::vector<double> outcome(thread_num);
+    std::vector<long long> move_count(thread_num*4);
+    std::vector<int> bad(thread_num);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < thread_num; ++t)
+    {
+        workers.push_back(std::thread([&, t](void)
+        {
+            std::vector<ds_sample> chunk;
+            for (int c = t; c < reader.get_chunk_num(); c += thread_num)
+            {
+                chunk.clear();
+                if (!reader.read_chunk(c, chunk))
+                {
+                    fprintf(stderr, "%s: chunk %d is corrupt\n", filename, c);
+                    ++bad[t];
+                    continue;
+                }
+                for (size_t k = 0; k < chunk.size(); ++k)
+                {
+                    outcome[t] += chunk[k].final_score;
+                    ++move_count[t*4 + (chunk[k].move & 3)];
+                }
+                samples[t] += chunk.size();
+            }
+        }));
+    }
+    long long total = 0;
+    double sum = 0;
+    long long by_move[4] = {0, 0, 0, 0};
+    int bad_num = 0;
+    for (int t = 0; t < thread_num; ++t)
+    {
+        workers[t].join();
+        bad_num += bad[t];
+        total += samples[t];
+        sum += outcome[t];
+        for (int k = 0; k < 4; ++k)
+        {
+            by_move[k] += move_count[t*4 + k];
+        }
+    }
+    printf("chunks: %8d\n", reader.get_chunk_num());
+    printf("samples:%8lld\n", total);
+    printf("outcome:%8.1lf mean final score per sample\n", total? sum/total: 0);
+    printf("moves:  %8lld %8lld %8lld %8lld (up right down left)\n",
+        by_move[0], by_move[1], by_move[2], by_move[3]);
+    if (bad_num)
+    {
+        // the figures above leave those chunks out
+        fprintf(stderr, "%s: %d corrupt chunks skipped\n", filename, bad_num);
+        return -1;
+    }
+    return total;
+}
+
+
+int main(int argc, char **argv)
 {
     srand(time(0));
+    if (argc > 1 && !strcmp(argv[1], "rows"))
+    {
+        // main rows [path]   builds the shared row table file
+        const char *path = argc > 2? argv[2]: rows::default_path();
+        if (!rows::install(path))
+        {
+            fprintf(stderr, "rows: cannot write %s\n", path);
+            return 1;
+        }
+        return 0;
+    }
+    rows::load();
+    if (argc > 1 && !strcmp(argv[1], "serve"))
+    {
+        // main serve          -> requests on stdin, answers on stdout
+        // main serve <path>   -> requests on a unix socket
+        if (argc > 2)
+        {
+            return service::serve_socket(argv[2]);
+        }
+        service::run(0, 1);
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "bulk"))
+    {
+        // main bulk <in> [out] [threads]   "-" for stdin / stdout
+        long long count = bulk::run(argv[2], argc > 3? argv[3]: "-", argc > 4? atoi(argv[4]): 0);
+        if (count >= 0)
+        {
+            fprintf(stderr, "bulk: %lld positions\n", count);
+        }
+        return count < 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "selfplay"))
+    {
+        // main selfplay <out> [games] [threads]   labelled samples
+        return test::export_selfplay(argv[2], argc > 3? atoi(argv[3]): 100,
+            argc > 4? atoi(argv[4]): 0) <= 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "dataset"))
+    {
+        // main dataset <file>   summary of a selfplay file
+        return test::dataset_summary(argv[2]) < 0;
+    }
+    if (argc > 3 && !strcmp(argv[1], "sprt"))
+    {
+        // main sprt A B [target] [delta] [max_pairs]
+        // A, B: log/G* style weight files, "-" for the built-in weights
+        // target: tile whose reach rate is compared, 0 for the score
+        creature a, b;
+        bool a_ok = sprt::load_config(argv[2], a);
+        if (!a_ok || !sprt::load_config(argv[3], b))
+        {
+            fprintf(stderr, "sprt: cannot read %s\n", a_ok? argv[3]: argv[2]);
+            return 1;
+        }
+        int max_pairs = argc > 6? atoi(argv[6]): SPRT_MAX_PAIRS;
+        if (max_pairs < 1)
+        {
+            fprintf(stderr, "sprt: max_pairs must be at least 1\n");
+            return 1;
+        }
+        int verdict = sprt::run(a, b, argc > 4? atoi(argv[4]): 0, argc > 5? atof(argv[5]): 0,
+            max_pairs);
+        return verdict == SPRT_NONE? 2: 0;
+    }
     // while (true)
     // {
     //     double k1 = double(rand() % 100)/20;
@@ -135,7 +687,26 @@ int main()
     //     printf("[%7.4lf %7.4lf]", k1, k2);
     //     test(TEST_ROUND);
     // }
+    // solver::set_depth(true, 20000);
+    // solver::set_engine(solver::ENGINE_MONTE_CARLO);
+    // ntuple_net net;
+    // ntuple::train(net, 100000);
+    // net.save("ntuple.bin");
+    // net.load("ntuple.bin");
+    // evaluater::set_ntuple(&net);
     test::test(1);
+    // test::batch_speed(100000, BATCH_RANDOM);
+    // test::chance_agreement(200, 6, 2);
+    // test::interleave_speed(1000, solver::INTERLEAVE_WIDTH);
+    // test::ponder_latency(300, 20);
+    // test::table_probe_speed(24, 1 << 24);
+    // retrograde exact;
+    // exact.build(3, 8, RG_WIN);
+    // exact.save("exact3.bin");
+    // exact.load("exact3.bin");
+    // test::exact_agreement(exact, 100);
+    // solver::set_exact(&exact);
+
     // printf("%7.2lf\n", test::test(test::TEST_ROUND));
     // creature c;
     // c.set_rand_k();
@@ -148,6 +719,7 @@ int main()
     // printf("%lf %lf\n", c.score, c.max_val);
     // generation g;
     // g.run("starter/S_2", 30);
+    // g.run_steady("starter/S_2", 30, 0);
     return 0;
 }
 
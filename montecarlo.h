@@ -0,0 +1,351 @@
+#ifndef MONTECARLO_H
+#define MONTECARLO_H
+
+#include "game2048.h"
+#include "batch.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+
+namespace montecarlo
+{
+    // rollout config
+    int ROLLOUT_NUM = 2048;    // max rollouts per root move
+    double TIME_BUDGET = 0;    // max seconds per decision, 0 for no limit
+    int THREAD_NUM = 0;        // 0 for one per core
+    int POLICY = BATCH_RANDOM;
+
+    // rollouts per root move between two significance checks
+    const int ROUND_ROLLOUTS = 256;
+    // stop once the best move leads every other one by STOP_Z standard errors
+    const double STOP_Z = 3.0;
+    const int MIN_ROUNDS = 2;
+
+    const double DOUBLE_INF = 1e10;
+
+    struct move_stat
+    {
+        double sum;
+        double sum_sq;
+        long long n;
+    };
+
+    // last decision
+    double last_value;
+    long long last_rollouts;
+
+    void set_rollout(int rollout_num, double time_budget=0, int thread_num=0);
+
+    // the move `policy` picks, as batch2048::step_block does: uniform
+    // over the legal moves, or the most empty cells after it, then score
+    int policy_move(const game2048 &game, int mask, int policy, uint32_t &seed)
+    {
+        int opt_i = 0;
+        if (policy == BATCH_GREEDY)
+        {
+            long long best = -1;
+            for (int d = 0; d < 4; ++d)
+            {
+                if (!(mask >> d & 1))
+                {
+                    continue;
+                }
+                game2048 next(game);
+                long long gain = next.opt(d);
+                long long val = (long long)next.get_empty_num() << 32 | gain;
+                if (val > best)
+                {
+                    best = val;
+                    opt_i = d;
+                }
+            }
+            return opt_i;
+        }
+        int r = xorshift32(seed) % __builtin_popcount(mask);
+        for (; !(mask >> opt_i & 1) || r--; ++opt_i);
+        return opt_i;
+    }
+
+    // plays `after` (a position before the spawn) to the end with
+    // `policy` on game2048 itself, for boards the batch can't hold
+    double rollout(const game2048 &after, uint32_t &seed, int policy=BATCH_RANDOM)
+    {
+        game2048 game(after);
+        double score = 0;
+        while (game.get_empty_num())
+        {
+            game.generate_new(seed);
+            int mask = game.get_move_mask();
+            if (!mask)
+            {
+                break;
+            }
+            int gain = game.opt(policy_move(game, mask, policy, seed));
+            score += gain;
+        }
+        return score;
+    }
+
+    inline int first_legal(const bool *legal)
+    {
+        int opt_i = 0;
+        while (opt_i < 3 && !legal[opt_i])
+        {
+            ++opt_i;
+        }
+        return opt_i;
+    }
+
+    void run_share(game2048 *const *children, const bool *legal, int rollouts,
+        uint32_t seed, move_stat *stat)
+    {
+        if (children[first_legal(legal)]->get_size() == 4)
+        {
+            batch2048 batch(rollouts < 256? rollouts: 256, seed);
+            batch.set_policy(POLICY);
+            for (int opt_i = 0; opt_i < 4; ++opt_i)
+            {
+                if (!legal[opt_i])
+                {
+                    continue;
+                }
+                batch.results.clear();
+                batch.set_start(*children[opt_i], 1);
+                batch.start(rollouts);
+                batch.run();
+                for (size_t i = 0; i < batch.results.size(); ++i)
+                {
+                    double val = batch.results[i].score;
+                    stat[opt_i].sum += val;
+                    stat[opt_i].sum_sq += val*val;
+                    ++stat[opt_i].n;
+                }
+            }
+            return;
+        }
+        for (int opt_i = 0; opt_i < 4; ++opt_i)
+        {
+            for (int i = 0; legal[opt_i] && i < rollouts; ++i)
+            {
+                double val = children[opt_i]->get_score() + rollout(*children[opt_i], seed, POLICY);
+                stat[opt_i].sum += val;
+                stat[opt_i].sum_sq += val*val;
+                ++stat[opt_i].n;
+            }
+        }
+    }
+
+    // worker threads kept across rounds and decisions, one pool per
+    // calling thread; every round hands each worker one share
+    struct pool
+    {
+        std::vector<std::thread> threads;
+        std::vector<uint32_t> seeds;
+        std::mutex lock;
+        std::condition_variable job_ready;
+        std::condition_variable done_ready;
+        // the round being run
+        game2048 *const *children;
+        const bool *legal;
+        int rollouts;
+        move_stat *stat; // 4 per worker
+        long long round;
+        int pending;
+        bool quit;
+
+        pool(void): children(NULL), legal(NULL), rollouts(0), stat(NULL),
+            round(0), pending(0), quit(false) {}
+        ~pool(void) { resize(0); }
+
+        void work(int t, long long seen)
+        {
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    job_ready.wait(guard, [&] { return quit || round != seen; });
+                    if (quit)
+                    {
+                        return;
+                    }
+                    seen = round;
+                }
+                run_share(children, legal, rollouts, seeds[t], stat + t*4);
+                std::lock_guard<std::mutex> guard(lock);
+                if (!--pending)
+                {
+                    done_ready.notify_one();
+                }
+            }
+        }
+
+        void resize(int thread_num)
+        {
+            if (int(threads.size()) == thread_num)
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                quit = true;
+                job_ready.notify_all();
+            }
+            for (size_t t = 0; t < threads.size(); ++t)
+            {
+                threads[t].join();
+            }
+            threads.clear();
+            quit = false;
+            seeds.resize(thread_num);
+            for (int t = 0; t < thread_num; ++t)
+            {
+                threads.push_back(std::thread(&pool::work, this, t, round));
+            }
+        }
+
+        // one round of `rollouts` per worker and legal move, into stat
+        void run(game2048 *const *_children, const bool *_legal, int _rollouts,
+            move_stat *_stat)
+        {
+            for (size_t t = 0; t < threads.size(); ++t)
+            {
+                seeds[t] = uint32_t(rand()) * 2654435761u + t + 1;
+                for (int opt_i = 0; opt_i < 4; ++opt_i)
+                {
+                    _stat[t*4 + opt_i].sum = _stat[t*4 + opt_i].sum_sq = 0;
+                    _stat[t*4 + opt_i].n = 0;
+                }
+            }
+            std::unique_lock<std::mutex> guard(lock);
+            children = _children;
+            legal = _legal;
+            rollouts = _rollouts;
+            stat = _stat;
+            pending = int(threads.size());
+            ++round;
+            job_ready.notify_all();
+            done_ready.wait(guard, [this] { return !pending; });
+        }
+    };
+
+    thread_local pool workers;
+
+    void set_rollout(int rollout_num, double time_budget /*=0*/, int thread_num /*=0*/)
+    {
+        ROLLOUT_NUM = rollout_num;
+        TIME_BUDGET = time_budget;
+        THREAD_NUM = thread_num;
+    }
+
+    int solve(const game2048 &game)
+    {
+        std::chrono::steady_clock::time_point start_t = std::chrono::steady_clock::now();
+        int thread_num = THREAD_NUM;
+        if (thread_num <= 0)
+        {
+            thread_num = std::thread::hardware_concurrency();
+            thread_num = thread_num > 0? thread_num: 1;
+        }
+        game2048 *children[4];
+        bool legal[4];
+        int legal_num = 0;
+        int only = 0;
+        int mask = game.get_move_mask();
+        for (int opt_i = 0; opt_i < 4; ++opt_i)
+        {
+            legal[opt_i] = mask >> opt_i & 1;
+            children[opt_i] = NULL;
+            if (legal[opt_i])
+            {
+                children[opt_i] = new game2048(game);
+                children[opt_i]->opt(opt_i);
+                ++legal_num;
+                only = opt_i;
+            }
+        }
+        last_rollouts = 0;
+        last_value = -DOUBLE_INF;
+        move_stat stat[4] = {};
+        std::vector<move_stat> share_stat(thread_num*4);
+        int best = only;
+        if (legal_num > 1)
+        {
+            workers.resize(thread_num);
+        }
+        for (int round = 1; legal_num > 1 && (round*ROUND_ROLLOUTS <= ROLLOUT_NUM || round == 1); ++round)
+        {
+            int per_thread = (ROUND_ROLLOUTS + thread_num - 1) / thread_num;
+            workers.run(children, legal, per_thread, share_stat.data());
+            for (int t = 0; t < thread_num; ++t)
+            {
+                for (int opt_i = 0; opt_i < 4; ++opt_i)
+                {
+                    stat[opt_i].sum += share_stat[t*4 + opt_i].sum;
+                    stat[opt_i].sum_sq += share_stat[t*4 + opt_i].sum_sq;
+                    stat[opt_i].n += share_stat[t*4 + opt_i].n;
+                }
+            }
+
+            double mean[4];
+            double var[4];
+            best = -1;
+            for (int opt_i = 0; opt_i < 4; ++opt_i)
+            {
+                if (!legal[opt_i])
+                {
+                    continue;
+                }
+                double n = double(stat[opt_i].n);
+                mean[opt_i] = stat[opt_i].sum / n;
+                var[opt_i] = (stat[opt_i].sum_sq / n - mean[opt_i]*mean[opt_i]) / n;
+                if (best == -1 || mean[opt_i] > mean[best])
+                {
+                    best = opt_i;
+                }
+            }
+
+            if (TIME_BUDGET > 0 && std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start_t).count() >= TIME_BUDGET)
+            {
+                break;
+            }
+            if (round < MIN_ROUNDS)
+            {
+                continue;
+            }
+            bool ahead = true;
+            for (int opt_i = 0; opt_i < 4 && ahead; ++opt_i)
+            {
+                if (legal[opt_i] && opt_i != best)
+                {
+                    double se = sqrt(var[best] + var[opt_i]);
+                    ahead = mean[best] - mean[opt_i] > STOP_Z*se;
+                }
+            }
+            if (ahead)
+            {
+                break;
+            }
+        }
+        for (int opt_i = 0; opt_i < 4; ++opt_i)
+        {
+            last_rollouts += stat[opt_i].n;
+            delete children[opt_i];
+        }
+        if (stat[best].n)
+        {
+            last_value = stat[best].sum / stat[best].n;
+        }
+        return best;
+    }
+}
+
+
+
+#endif
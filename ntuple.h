@@ -0,0 +1,443 @@
+#ifndef NTUPLE_H
+#define NTUPLE_H
+
+#include "game2048.h"
+#include "symmetry.h"
+#include "tablemem.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+const int NT_MAX_TUPLES = 16;
+const int NT_MAX_LEN = 6;
+const int NT_CELLS = 16; // 4x4 boards only
+const int NT_VALUES = 16; // exponents above 15 share the last entry
+
+const char NT_MAGIC[4] = {'N', 'T', 'U', 'P'};
+const uint32_t NT_VERSION = 1;
+
+// two lines and three squares, 5 * 16^4 weights
+const int NT_SMALL_NUM = 5;
+const int NT_SMALL_LEN[NT_SMALL_NUM] = {4, 4, 4, 4, 4};
+const int NT_SMALL_CELLS[NT_SMALL_NUM][NT_MAX_LEN] = {
+    {0, 1, 2, 3}, {4, 5, 6, 7}, {0, 1, 4, 5}, {1, 2, 5, 6}, {5, 6, 9, 10},
+};
+
+// the usual four 6-tuples, 4 * 16^6 weights (256 MB)
+const int NT_LARGE_NUM = 4;
+const int NT_LARGE_LEN[NT_LARGE_NUM] = {6, 6, 6, 6};
+const int NT_LARGE_CELLS[NT_LARGE_NUM][NT_MAX_LEN] = {
+    {0, 1, 2, 3, 4, 5}, {4, 5, 6, 7, 8, 9}, {0, 1, 2, 4, 5, 6}, {4, 5, 6, 8, 9, 10},
+};
+
+
+// file layout: magic, version, tuple_num, then len and NT_MAX_LEN cells
+// per tuple (all uint32), then the float weights of every tuple in order
+struct nt_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t tuple_num;
+    uint32_t len[NT_MAX_TUPLES];
+    uint32_t cells[NT_MAX_TUPLES][NT_MAX_LEN];
+};
+
+
+// lookup-table evaluator: every tuple is read in all 8 orientations of
+// the board and the value is the sum of the weights it indexes
+class ntuple_net
+{
+public:
+    ntuple_net();
+    ~ntuple_net();
+
+    void set_tuples(int num, const int *_len, const int (*_cells)[NT_MAX_LEN]);
+    bool load(const char *filename);
+    bool save(const char *filename) const;
+
+    inline bool ready(void) const;
+    inline int get_feature_num(void) const;
+
+    double eval(const uint8_t *cell) const;
+    double eval(const game2048 &node) const;
+    void update(const uint8_t *cell, double delta);
+
+private:
+    int tuple_num;
+    int len[NT_MAX_TUPLES];
+    int cells[NT_MAX_TUPLES][NT_MAX_LEN];
+    int sym_cells[NT_MAX_TUPLES][SYM_NUM][NT_MAX_LEN];
+    float* weights[NT_MAX_TUPLES];
+
+    float* owned;
+    size_t owned_size;
+    void* mapped;
+    size_t mapped_size;
+
+    void release(void);
+    void set_layout(int num, const int *_len, const int (*_cells)[NT_MAX_LEN]);
+    inline size_t weight_num(void) const;
+};
+
+
+inline void nt_get_cells(const game2048 &node, uint8_t *cell)
+{
+    for (int k = 0; k < NT_CELLS; ++k)
+    {
+        int v = node.get(k / 4, k % 4);
+        cell[k] = uint8_t(v < NT_VALUES? v: NT_VALUES - 1);
+    }
+}
+
+
+ntuple_net::ntuple_net()
+{
+    tuple_num = 0;
+    owned = NULL;
+    owned_size = 0;
+    mapped = NULL;
+    mapped_size = 0;
+}
+
+ntuple_net::~ntuple_net()
+{
+    release();
+}
+
+
+void ntuple_net::release(void)
+{
+    tablemem::release(owned, owned_size);
+    owned = NULL;
+    owned_size = 0;
+    if (mapped)
+    {
+        munmap(mapped, mapped_size);
+        mapped = NULL;
+    }
+    tuple_num = 0;
+}
+
+void ntuple_net::set_layout(int num, const int *_len, const int (*_cells)[NT_MAX_LEN])
+{
+    tuple_num = num;
+    for (int t = 0; t < num; ++t)
+    {
+        len[t] = _len[t];
+        for (int k = 0; k < len[t]; ++k)
+        {
+            cells[t][k] = _cells[t][k];
+            for (int s = 0; s < SYM_NUM; ++s)
+            {
+                sym_cells[t][s][k] = sym_cell(s, cells[t][k], 4);
+            }
+        }
+    }
+}
+
+inline size_t ntuple_net::weight_num(void) const
+{
+    size_t n = 0;
+    for (int t = 0; t < tuple_num; ++t)
+    {
+        n += size_t(1) << (4*len[t]);
+    }
+    return n;
+}
+
+
+void ntuple_net::set_tuples(int num, const int *_len, const int (*_cells)[NT_MAX_LEN])
+{
+    release();
+    set_layout(num, _len, _cells);
+    // probed by every search and training thread
+    owned_size = weight_num()*sizeof(float);
+    owned = (float*)tablemem::alloc(owned_size, true);
+    float *p = owned;
+    for (int t = 0; t < tuple_num; ++t)
+    {
+        weights[t] = p;
+        p += size_t(1) << (4*len[t]);
+    }
+}
+
+bool ntuple_net::load(const char *filename)
+{
+    // weights stay in the page cache and are shared by every process
+    // using the same file; MAP_PRIVATE keeps further training local
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || size_t(st.st_size) < sizeof(nt_header))
+    {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+    const nt_header *h = (const nt_header*)p;
+    if (memcmp(h->magic, NT_MAGIC, 4) || h->version != NT_VERSION ||
+        h->tuple_num > uint32_t(NT_MAX_TUPLES))
+    {
+        munmap(p, st.st_size);
+        return false;
+    }
+    int _len[NT_MAX_TUPLES];
+    int _cells[NT_MAX_TUPLES][NT_MAX_LEN];
+    for (uint32_t t = 0; t < h->tuple_num; ++t)
+    {
+        _len[t] = h->len[t] <= uint32_t(NT_MAX_LEN)? h->len[t]: 0;
+        for (int k = 0; k < NT_MAX_LEN; ++k)
+        {
+            _cells[t][k] = h->cells[t][k] % NT_CELLS;
+        }
+    }
+    release();
+    set_layout(h->tuple_num, _len, _cells);
+    if (sizeof(nt_header) + weight_num()*sizeof(float) != size_t(st.st_size))
+    {
+        munmap(p, st.st_size);
+        tuple_num = 0;
+        return false;
+    }
+    mapped = p;
+    mapped_size = st.st_size;
+    float *w = (float*)((char*)p + sizeof(nt_header));
+    for (int t = 0; t < tuple_num; ++t)
+    {
+        weights[t] = w;
+        w += size_t(1) << (4*len[t]);
+    }
+    return true;
+}
+
+bool ntuple_net::save(const char *filename) const
+{
+    nt_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, NT_MAGIC, 4);
+    h.version = NT_VERSION;
+    h.tuple_num = tuple_num;
+    for (int t = 0; t < tuple_num; ++t)
+    {
+        h.len[t] = len[t];
+        for (int k = 0; k < len[t]; ++k)
+        {
+            h.cells[t][k] = cells[t][k];
+        }
+    }
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, file) == 1;
+    for (int t = 0; ok && t < tuple_num; ++t)
+    {
+        size_t n = size_t(1) << (4*len[t]);
+        ok = fwrite(weights[t], sizeof(float), n, file) == n;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+
+inline bool ntuple_net::ready(void) const
+{
+    return tuple_num > 0;
+}
+
+inline int ntuple_net::get_feature_num(void) const
+{
+    return tuple_num*SYM_NUM;
+}
+
+
+double ntuple_net::eval(const uint8_t *cell) const
+{
+    double val = 0;
+    for (int t = 0; t < tuple_num; ++t)
+    {
+        const float *w = weights[t];
+        for (int s = 0; s < SYM_NUM; ++s)
+        {
+            const int *c = sym_cells[t][s];
+            uint32_t index = 0;
+            for (int k = 0; k < len[t]; ++k)
+            {
+                index |= uint32_t(cell[c[k]]) << (4*k);
+            }
+            val += w[index];
+        }
+    }
+    return val;
+}
+
+double ntuple_net::eval(const game2048 &node) const
+{
+    uint8_t cell[NT_CELLS];
+    nt_get_cells(node, cell);
+    return eval(cell);
+}
+
+void ntuple_net::update(const uint8_t *cell, double delta)
+{
+    // training threads update the shared tables without locking
+    // (Hogwild); an occasional lost update doesn't hurt convergence
+    float d = float(delta / get_feature_num());
+    for (int t = 0; t < tuple_num; ++t)
+    {
+        float *w = weights[t];
+        for (int s = 0; s < SYM_NUM; ++s)
+        {
+            const int *c = sym_cells[t][s];
+            uint32_t index = 0;
+            for (int k = 0; k < len[t]; ++k)
+            {
+                index |= uint32_t(cell[c[k]]) << (4*k);
+            }
+            w[index] += d;
+        }
+    }
+}
+
+
+namespace ntuple
+{
+    // training config
+    double LEARNING_RATE = 0.1;
+    const int PRINT_GAME_STEP = 1000;
+
+    std::atomic<long long> games_started;
+    std::atomic<long long> games_done;
+    std::atomic<long long> score_sum;
+    std::atomic<long long> reach_2048;
+
+    // one self-play game with TD(0) on afterstates: the move maximizes
+    // reward + V(afterstate), and V(last afterstate) is pulled towards
+    // reward + V(next afterstate), or 0 when the game ends
+    void train_game(ntuple_net &net, uint32_t &seed)
+    {
+        game2048 game;
+        game.clear_board();
+        game.generate_new(seed);
+        game.generate_new(seed);
+        uint8_t prev[NT_CELLS];
+        uint8_t after[NT_CELLS];
+        uint8_t best_after[NT_CELLS];
+        bool has_prev = false;
+        long long score = 0;
+        while (true)
+        {
+            int best = -1;
+            int best_r = 0;
+            double best_v = 0;
+            double best_eval = 0;
+            int mask = game.get_move_mask();
+            for (int opt_i = 0; opt_i < 4; ++opt_i)
+            {
+                if (!(mask >> opt_i & 1))
+                {
+                    continue;
+                }
+                game2048 child(game);
+                int r = child.opt(opt_i);
+                nt_get_cells(child, after);
+                double v = net.eval(after);
+                if (best == -1 || r + v > best_v)
+                {
+                    best = opt_i;
+                    best_r = r;
+                    best_v = r + v;
+                    best_eval = v;
+                    memcpy(best_after, after, NT_CELLS);
+                }
+            }
+            if (best == -1)
+            {
+                if (has_prev)
+                {
+                    net.update(prev, LEARNING_RATE*(0 - net.eval(prev)));
+                }
+                break;
+            }
+            if (has_prev)
+            {
+                net.update(prev, LEARNING_RATE*(best_r + best_eval - net.eval(prev)));
+            }
+            memcpy(prev, best_after, NT_CELLS);
+            has_prev = true;
+            score += game.opt(best);
+            game.generate_new(seed);
+        }
+        score_sum += score;
+        if (game.get_max_val() >= 11)
+        {
+            ++reach_2048;
+        }
+    }
+
+    void train_worker(ntuple_net *net, long long games, uint32_t seed)
+    {
+        while (games_started++ < games)
+        {
+            train_game(*net, seed);
+            long long done = ++games_done;
+            if (done % PRINT_GAME_STEP == 0)
+            {
+                long long s = score_sum.exchange(0);
+                long long r = reach_2048.exchange(0);
+                printf("%8lld| %10.1lf| %5.1lf%%\n", done,
+                    double(s)/PRINT_GAME_STEP, 100.0*r/PRINT_GAME_STEP);
+            }
+        }
+    }
+
+    // self-play training on thread_num threads (0 for one per core);
+    // prints mean score and 2048 rate every PRINT_GAME_STEP games
+    void train(ntuple_net &net, long long games, int thread_num=0)
+    {
+        if (!net.ready())
+        {
+            net.set_tuples(NT_SMALL_NUM, NT_SMALL_LEN, NT_SMALL_CELLS);
+        }
+        if (thread_num <= 0)
+        {
+            thread_num = std::thread::hardware_concurrency();
+            thread_num = thread_num > 0? thread_num: 1;
+        }
+        games_started = 0;
+        games_done = 0;
+        score_sum = 0;
+        reach_2048 = 0;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < thread_num; ++t)
+        {
+            uint32_t seed = (uint32_t(time(0)) * 2654435761u + t) | 1;
+            workers.push_back(std::thread(train_worker, &net, games, seed));
+        }
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers[t].join();
+        }
+    }
+}
+
+
+
+#endif
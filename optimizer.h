@@ -9,6 +9,13 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 
 const int CREATURE_NUM = 50;
@@ -17,6 +24,14 @@ const double MUTATE_RATE = 0.25;
 const double MUTATE_MAX_VAL = 0.5;
 const double NEW_CREATURE_RATE = 0.72;
     // rate of killing last 10% creatures and generating a new one
+const int MIN_TEST_ROUND = 27; // creatures are re-evaluated up to this
+
+// param: the empty / max / smooth weights, SVK1, SVK2, then the weights
+// of the other evaluater features, so the count is fixed by FEATURE_NUM;
+// files with fewer params per line (the old 5) load with the rest at 0,
+// extra params on a line are ignored
+const int PARAM_NUM = evaluater::FEATURE_NUM + 2;
+const int PARSE_MAX = 64; // numbers read from one log line
 
 
 int randint(int a, int b)
@@ -35,21 +50,31 @@ double randf(double a, double b)
     return randf()*(b - a) + a;
 }
 
+// the rank rule of kill(): the i-th of m creatures, best first, dies
+// with chance i/m
+bool survives(int i, int m)
+{
+    return randint(0, m - 1) >= i;
+}
+
 
 class creature
 {
 public:
-    double param[5];
+    double param[PARAM_NUM];
     int test_round;
     double tot_score;
     double tot_max_val;
 
     void reset_test_data(void);
     creature();
+    creature(const creature &c) = default;
     void operator=(const creature &c);
 
     void set_rand_k(void);
-    void eval(int round=ROUND_PER_TEST);
+    bool parse(const char *line);
+    void apply(void) const;
+    void eval(int round=ROUND_PER_TEST, uint32_t seed=0);
 
     void mutate(void);
 };
@@ -63,11 +88,18 @@ public:
     int kill(void);
     void next(void);
 
-    void load_from_file(const char *filename, int file_creature_num=CREATURE_NUM);
+    void load_from_file(const char *filename, int file_creature_num=CREATURE_NUM, bool evaluate=true);
     void log_to_cmd(void) const;
     void log_to_file(const char *filename) const;
 
     void run(const char *filename="\0", int file_creature_num=CREATURE_NUM);
+    void run_steady(const char *filename="\0", int file_creature_num=CREATURE_NUM,
+        int thread_num=0, int generation_num=0);
+
+private:
+    int rank(int *order) const;
+    int pick(const int *order, int m, bool survivor) const;
+    creature breed(const int *order, int m) const;
 };
 
 
@@ -90,7 +122,7 @@ void creature::operator=(const creature &c)
     test_round = c.test_round;
     tot_score = c.tot_score;
     tot_max_val = c.tot_max_val;
-    for (int i = 0; i < 5; ++i)
+    for (int i = 0; i < PARAM_NUM; ++i)
     {
         param[i] = c.param[i];
     }
@@ -114,51 +146,109 @@ void creature::set_rand_k(void)
 
     param[3] = randf(-3, 3);
     param[4] = randf(-3, 3);
+
+    for (int i = 5; i < PARAM_NUM; ++i)
+    {
+        param[i] = randf(-10, 35);
+    }
 }
 
-void creature::eval(int round /*=5*/)
+// one line of a log/G* file: params, test_round, tot_score, tot_max_val
+bool creature::parse(const char *line)
 {
-    srand(time(0));
-    evaluater::set_weight(param[0], param[1], param[2]);
+    double num[PARSE_MAX];
+    int n = 0;
+    const char *p = line;
+    char *end;
+    for (double x = strtod(p, &end); end != p && n < PARSE_MAX; x = strtod(p, &end))
+    {
+        num[n++] = x;
+        p = end;
+    }
+    if (n < 4)
+    {
+        return false;
+    }
+    for (int j = 0; j < PARAM_NUM; ++j)
+    {
+        param[j] = j < n - 3? num[j]: 0;
+    }
+    test_round = int(num[n - 3]);
+    tot_score = num[n - 2];
+    tot_max_val = num[n - 1];
+    return true;
+}
+
+// params to the calling thread's evaluater
+void creature::apply(void) const
+{
+    double w[evaluater::FEATURE_NUM];
+    for (int i = 0; i < 3; ++i)
+    {
+        w[i] = param[i];
+    }
+    for (int i = 5; i < PARAM_NUM; ++i)
+    {
+        w[i - 2] = param[i];
+    }
+    evaluater::set_weights(w, evaluater::FEATURE_NUM);
     evaluater::set_svk(param[3], param[4]);
-    game2048 game;
-    for (int round_i = 1; round_i <= round; ++round_i)
+}
+
+
+// a game from an empty board to the end, spawns drawn from seed
+void self_play(game2048 &game, uint32_t &seed)
+{
+    game.clear_board();
+    game.generate_new(seed);
+    do
     {
-        game.clear_board();
-        game.generate_new();
-        int opt_i;
-        do
+        game.generate_new(seed);
+        if (game.is_dead())
         {
-            game.generate_new();
-            do
-            {
-                opt_i = solver::solve(game);
-            }while (game.opt(opt_i) == -1 && !game.is_dead());
-        }while (game.get_empty_num());
+            break;
+        }
+        game.opt(solver::solve(game));
+    }while (game.get_empty_num());
+}
 
+// games are played with spawns drawn from seed; 0 seeds from the
+// clock, so creatures evaluated in the same second see the same games
+void creature::eval(int round /*=ROUND_PER_TEST*/, uint32_t seed /*=0*/)
+{
+    if (!seed)
+    {
+        seed = uint32_t(time(0)) | 1;
+    }
+    apply();
+    solver::TABLE->clear();
+    game2048 game;
+    for (int round_i = 1; round_i <= round; ++round_i)
+    {
+        self_play(game, seed);
         tot_score += game.get_score();
         tot_max_val += 1 << game.get_max_val();
     }
-    test_round += ROUND_PER_TEST;
+    test_round += round;
 }
 
 
 void creature::mutate(void)
 {
-    param[randint(0, 4)] += randf(-MUTATE_MAX_VAL, MUTATE_MAX_VAL);
+    param[randint(0, PARAM_NUM - 1)] += randf(-MUTATE_MAX_VAL, MUTATE_MAX_VAL);
 }
 
 
 creature crossover(const creature &c1, const creature &c2)
 {
     creature c;
-    int crossover_point = randint(0, 4);
-    // [0..cp)[cp..4]
+    int crossover_point = randint(0, PARAM_NUM - 1);
+    // [0..cp)[cp..PARAM_NUM)
     for (int i = 0; i < crossover_point; ++i)
     {
         c.param[i] = c1.param[i];
     }
-    for (int i = crossover_point; i < 5; ++i)
+    for (int i = crossover_point; i < PARAM_NUM; ++i)
     {
         c.param[i] = c2.param[i];
     }
@@ -181,7 +271,7 @@ int generation::kill(void)
     int remain_num = 0;
     for (int i = 0; i < CREATURE_NUM; ++i)
     {
-        if (randint(0, CREATURE_NUM - 1) >= i)
+        if (survives(i, CREATURE_NUM))
         {
             // alive
             std::swap(creatures[remain_num], creatures[i]);
@@ -216,7 +306,7 @@ void generation::next(void)
     }
     for (int i = 0; i < CREATURE_NUM; ++i)
     {
-        if (creatures[i].test_round < 27)
+        if (creatures[i].test_round < MIN_TEST_ROUND)
         {
             creatures[i].eval();
         }
@@ -224,26 +314,37 @@ void generation::next(void)
 }
 
 
-void generation::load_from_file(const char *filename, int file_creature_num /*=CREATURE_NUM*/)
+// without evaluate, creatures missing from the file or never tested are
+// left at test_round 0
+void generation::load_from_file(const char *filename, int file_creature_num /*=CREATURE_NUM*/,
+    bool evaluate /*=true*/)
 {
+    // one creature per line: params, test_round, tot_score, tot_max_val
     std::ifstream file;
     file.open(filename, std::ios::in);
-    for (int i = 0; i < file_creature_num; ++i)
+    std::string line;
+    int i = 0;
+    while (i < file_creature_num && std::getline(file, line))
     {
-        for (int j = 0; j < 5; ++j)
+        creature &c = creatures[i];
+        if (!c.parse(line.c_str()))
         {
-            file >> creatures[i].param[j];
+            continue;
         }
-        file >> creatures[i].test_round >> creatures[i].tot_score >> creatures[i].tot_max_val;
-        if (!creatures[i].test_round)
+        ++i;
+        if (!c.test_round && evaluate)
         {
-            creatures[i].eval();
+            c.eval();
         }
     }
+    file_creature_num = i;
     for (int i = file_creature_num; i < CREATURE_NUM; ++i)
     {
         creatures[i].set_rand_k();
-        creatures[i].eval();
+        if (evaluate)
+        {
+            creatures[i].eval();
+        }
     }
     file.close();
 }
@@ -257,7 +358,7 @@ void generation::log_to_cmd(void) const
             creatures[i].tot_max_val/creatures[i].test_round, 
             creatures[i].test_round);
         printf("[");
-        for (int j = 0; j < 5; ++j)
+        for (int j = 0; j < PARAM_NUM; ++j)
         {
             printf("%7.2lf ", creatures[i].param[j]);
         }
@@ -272,7 +373,7 @@ void generation::log_to_file(const char *filename) const
     file.open(filename, std::ios::out | std::ios::trunc);
     for (int i = 0; i < CREATURE_NUM; ++i)
     {
-        for (int j = 0; j < 5; ++j)
+        for (int j = 0; j < PARAM_NUM; ++j)
         {
             file << creatures[i].param[j] << " ";
         }
@@ -312,4 +413,261 @@ void generation::run(const char *load_filename /*="\0"*/, int file_creature_num
 
 
 
+// steady state evolution: workers evaluate one creature at a time and
+// the main thread folds each result in as soon as it arrives, so no
+// worker waits for the slowest game of a generation
+
+struct steady_job
+{
+    creature c;
+    int slot; // creature re-evaluated in place, -1 for a new child
+    long long id; // of the creature in slot when dispatched
+    uint32_t seed;
+};
+
+struct steady_queue
+{
+    std::mutex lock;
+    std::condition_variable job_ready;
+    std::condition_variable done_ready;
+    std::deque<steady_job> jobs;
+    std::deque<steady_job> done;
+    bool quit;
+};
+
+void steady_worker(steady_queue *q)
+{
+    // a table of its own; evaluater weights are per thread already
+    trans_table table(TT_BITS, false);
+    solver::TABLE = &table;
+    while (true)
+    {
+        steady_job job;
+        {
+            std::unique_lock<std::mutex> guard(q->lock);
+            q->job_ready.wait(guard, [q] { return q->quit || !q->jobs.empty(); });
+            if (q->quit)
+            {
+                return;
+            }
+            job = q->jobs.front();
+            q->jobs.pop_front();
+        }
+        job.c.eval(ROUND_PER_TEST, job.seed);
+        std::lock_guard<std::mutex> guard(q->lock);
+        q->done.push_back(job);
+        q->done_ready.notify_one();
+    }
+}
+
+
+// indices of the tested creatures, best first; returns their number
+int generation::rank(int *order) const
+{
+    int m = 0;
+    for (int i = 0; i < CREATURE_NUM; ++i)
+    {
+        if (creatures[i].test_round)
+        {
+            order[m++] = i;
+        }
+    }
+    std::sort(order, order + m, [this](int a, int b) { return cmp(creatures[a], creatures[b]); });
+    return m;
+}
+
+// a survivor or a victim by survives(), as in kill(), -1 if m < 2 (the best never dies)
+int generation::pick(const int *order, int m, bool survivor) const
+{
+    if (m < 2)
+    {
+        return -1;
+    }
+    while (true)
+    {
+        int i = randint(0, m - 1);
+        if (survives(i, m) == survivor)
+        {
+            return order[i];
+        }
+    }
+}
+
+creature generation::breed(const int *order, int m) const
+{
+    creature c;
+    // next() replaces the last 10% of a generation with new ones
+    if (m < 2 || randf() < 0.1)
+    {
+        c.set_rand_k();
+        return c;
+    }
+    c = crossover(creatures[pick(order, m, true)], creatures[order[randint(0, m - 1)]]);
+    if (randf() <= MUTATE_RATE)
+    {
+        c.mutate();
+    }
+    c.reset_test_data();
+    return c;
+}
+
+
+void generation::run_steady(const char *load_filename /*="\0"*/, int file_creature_num /*=CREATURE_NUM*/,
+    int thread_num /*=0*/, int generation_num /*=0*/)
+{
+    srand(time(0));
+    if (thread_num <= 0)
+    {
+        thread_num = std::thread::hardware_concurrency();
+        thread_num = thread_num > 0? thread_num: 1;
+    }
+    if (load_filename[0] == '\0')
+    {
+        for (int i = 0; i < CREATURE_NUM; ++i)
+        {
+            creatures[i].set_rand_k();
+        }
+    }
+    else
+    {
+        load_from_file(load_filename, file_creature_num, false);
+    }
+
+    steady_queue q;
+    q.quit = false;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < thread_num; ++t)
+    {
+        workers.push_back(std::thread(steady_worker, &q));
+    }
+    long long ids[CREATURE_NUM];
+    bool busy[CREATURE_NUM];
+    long long next_id = 0;
+    for (int i = 0; i < CREATURE_NUM; ++i)
+    {
+        ids[i] = next_id++;
+        busy[i] = false;
+    }
+    int order[CREATURE_NUM];
+
+    // untested creatures first; then, about as often as next() does,
+    // the least tested one short of MIN_TEST_ROUND or a new child
+    auto dispatch = [&](void)
+    {
+        steady_job job;
+        job.slot = -1;
+        job.id = -1;
+        job.seed = ((uint32_t(rand()) << 16) ^ uint32_t(rand())) | 1;
+        for (int i = 0; i < CREATURE_NUM; ++i)
+        {
+            if (!busy[i] && creatures[i].test_round < MIN_TEST_ROUND &&
+                (job.slot < 0 || creatures[i].test_round < creatures[job.slot].test_round))
+            {
+                job.slot = i;
+            }
+        }
+        if (job.slot >= 0 && creatures[job.slot].test_round && randf() < 0.5)
+        {
+            job.slot = -1;
+        }
+        if (job.slot >= 0)
+        {
+            job.id = ids[job.slot];
+            job.c = creatures[job.slot];
+            busy[job.slot] = true;
+        }
+        else
+        {
+            job.c = breed(order, rank(order));
+        }
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.jobs.push_back(job);
+        q.job_ready.notify_one();
+    };
+
+    std::chrono::steady_clock::time_point last_t = std::chrono::steady_clock::now();
+    for (int t = 0; t < thread_num; ++t)
+    {
+        dispatch();
+    }
+    char filename[40];
+    long long finished = 0;
+    long long next_snapshot = CREATURE_NUM;
+    for (int gen_i = 0; !generation_num || gen_i < generation_num; )
+    {
+        steady_job job;
+        {
+            std::unique_lock<std::mutex> guard(q.lock);
+            q.done_ready.wait(guard, [&q] { return !q.done.empty(); });
+            job = q.done.front();
+            q.done.pop_front();
+        }
+        if (job.slot >= 0)
+        {
+            // the creature may have been replaced meanwhile
+            if (ids[job.slot] == job.id)
+            {
+                creatures[job.slot] = job.c;
+                busy[job.slot] = false;
+            }
+        }
+        else
+        {
+            int m = rank(order);
+            int victim = m < CREATURE_NUM? -1: pick(order, m, false);
+            for (int i = 0; victim < 0 && i < CREATURE_NUM; ++i)
+            {
+                // an untested, idle slot while the population fills up
+                if (!creatures[i].test_round && !busy[i])
+                {
+                    victim = i;
+                }
+            }
+            if (victim < 0)
+            {
+                victim = pick(order, m, false);
+            }
+            // with more threads than creatures every untested slot can
+            // be busy while fewer than two are ranked; the child is lost
+            if (victim >= 0)
+            {
+                creatures[victim] = job.c;
+                ids[victim] = next_id++;
+                busy[victim] = false;
+            }
+        }
+        dispatch();
+
+        // one snapshot per CREATURE_NUM results, once every creature
+        // has been tested, in the same format as run()
+        if (++finished >= next_snapshot && rank(order) == CREATURE_NUM)
+        {
+            generation snap;
+            for (int k = 0; k < CREATURE_NUM; ++k)
+            {
+                snap.creatures[k] = creatures[order[k]];
+            }
+            printf("G%3d(%5.2lfs):\n", gen_i, std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - last_t).count());
+            snap.log_to_cmd();
+            sprintf(filename, "log/G%d", gen_i);
+            snap.log_to_file(filename);
+            last_t = std::chrono::steady_clock::now();
+            next_snapshot = finished + CREATURE_NUM;
+            ++gen_i;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.quit = true;
+        q.job_ready.notify_all();
+    }
+    for (int t = 0; t < thread_num; ++t)
+    {
+        workers[t].join();
+    }
+}
+
+
+
 #endif
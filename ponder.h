@@ -0,0 +1,191 @@
+#ifndef PONDER_H
+#define PONDER_H
+
+#include "game2048.h"
+#include "solver.h"
+#include <cstring>
+#include <atomic>
+#include <thread>
+
+
+// Searches the boards the last move can turn into while the real spawn
+// is not known yet, so the next solve() finds its subtrees in the
+// transposition table. Spawned 2s are searched before 4s, each board
+// exactly as solve() would search it. Once the real board is known,
+// hit() drops the other spawns and, given a spare core, searches that
+// board next to solve(), the two threads sharing the table. stop()
+// calls the search off; boards not finished by then leave nothing in
+// the table.
+class ponderer
+{
+public:
+    ponderer();
+    ~ponderer();
+
+    // after: the board after our move, before the spawn
+    void start(const game2048 &after);
+    // next: the board about to be solved; stop() once solve() returns
+    void hit(const game2048 &next);
+    void stop(void);
+
+    // of the last start(), once stopped
+    inline long long get_node_count(void) const;
+    inline int get_done(void) const;
+
+private:
+    std::thread worker;
+    std::atomic<bool> abort;
+    game2048 *board;
+    bool helper; // searching board itself, not its spawns
+    long long node_count;
+    int done;
+
+    // the starting thread's evaluation weights and table
+    double weights[evaluater::FEATURE_PAD];
+    double svk1;
+    double svk2;
+    trans_table *table;
+
+    void launch(const game2048 &b, bool _helper);
+    void run(void);
+};
+
+
+ponderer::ponderer()
+{
+    abort = false;
+    board = NULL;
+    helper = false;
+    node_count = 0;
+    done = 0;
+    table = NULL;
+}
+
+ponderer::~ponderer()
+{
+    stop();
+}
+
+
+void ponderer::start(const game2048 &after)
+{
+    launch(after, false);
+}
+
+void ponderer::hit(const game2048 &next)
+{
+    // on one core the helper would only take time from solve()
+    if (std::thread::hardware_concurrency() < 2)
+    {
+        stop();
+        return;
+    }
+    launch(next, true);
+}
+
+void ponderer::launch(const game2048 &b, bool _helper)
+{
+    stop();
+    node_count = 0;
+    done = 0;
+    // only the minimax engine reads the table, and only on boards it
+    // searches in place
+    if (solver::ENGINE != solver::ENGINE_MINIMAX || !b.undoable() ||
+        (solver::EXACT_TABLE && solver::EXACT_TABLE->get_size() == b.get_size()))
+    {
+        return;
+    }
+    board = new game2048(b);
+    helper = _helper;
+    memcpy(weights, evaluater::WEIGHTS, sizeof(weights));
+    svk1 = evaluater::SVK1;
+    svk2 = evaluater::SVK2;
+    table = solver::TABLE;
+    abort = false;
+    worker = std::thread(&ponderer::run, this);
+}
+
+void ponderer::stop(void)
+{
+    if (!board)
+    {
+        return;
+    }
+    abort = true;
+    worker.join();
+    delete board;
+    board = NULL;
+}
+
+
+inline long long ponderer::get_node_count(void) const
+{
+    return node_count;
+}
+
+inline int ponderer::get_done(void) const
+{
+    return done;
+}
+
+
+void ponderer::run(void)
+{
+    memcpy(evaluater::WEIGHTS, weights, sizeof(weights));
+    evaluater::SVK1 = svk1;
+    evaluater::SVK2 = svk2;
+    solver::TABLE = table;
+    solver::abort_flag = &abort;
+    solver::node_count = 0;
+    game2048 &node = *board;
+    int size = node.get_size();
+    if (helper)
+    {
+        // the root as solve() searches it, moves in reverse order so
+        // the two threads start on different subtrees
+        solver::last_depth = solver::pick_depth(node);
+        int mask = node.get_move_mask();
+        for (int opt_i = 3; opt_i >= 0 && !solver::aborted(); --opt_i)
+        {
+            if (mask >> opt_i & 1)
+            {
+                undo_token token = node.apply(opt_i);
+                solver::minimax(node, solver::last_depth, solver::PC_SIDE,
+                    -solver::DOUBLE_INF, solver::DOUBLE_INF);
+                node.undo(token);
+            }
+        }
+        done = !solver::aborted();
+    }
+    for (int v = 1; v <= 2 && !helper; ++v)
+    {
+        for (int c = 0; c < size*size && !solver::aborted(); ++c)
+        {
+            if (node.get(c / size, c % size))
+            {
+                continue;
+            }
+            undo_token spawn = node.spawn(c / size, c % size, v);
+            solver::last_depth = solver::pick_depth(node);
+            int mask = node.get_move_mask();
+            for (int opt_i = 0; opt_i < 4; ++opt_i)
+            {
+                if (mask >> opt_i & 1)
+                {
+                    undo_token token = node.apply(opt_i);
+                    solver::minimax(node, solver::last_depth, solver::PC_SIDE,
+                        -solver::DOUBLE_INF, solver::DOUBLE_INF);
+                    node.undo(token);
+                }
+            }
+            node.undo(spawn);
+            done += !solver::aborted();
+        }
+    }
+    node_count = solver::node_count;
+    solver::abort_flag = NULL;
+}
+
+
+
+#endif
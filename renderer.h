@@ -0,0 +1,242 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "game2048.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+
+const int RENDER_FPS = 30;
+const int RENDER_MAX_SIZE = 8;
+const int RENDER_STATUS_LINES = 8;
+const int RENDER_STATUS_LEN = 64;
+const int RENDER_CELL_WIDE = 5;
+
+
+struct render_frame
+{
+    int size;
+    int cells[RENDER_MAX_SIZE][RENDER_MAX_SIZE];
+    char status[RENDER_STATUS_LINES][RENDER_STATUS_LEN];
+};
+
+
+// Draws boards on its own thread. submit() copies the board into a
+// triple buffer and returns at once; the render thread picks up the
+// newest frame at most fps times a second and rewrites only the cells
+// and status lines that changed, using cursor positioning.
+class renderer
+{
+public:
+    renderer(int _fps=RENDER_FPS);
+    ~renderer();
+
+    void start(void);
+    void stop(void);
+
+    // status: up to RENDER_STATUS_LINES lines separated by '\n'
+    void submit(int size, int *const *board, const char *status);
+
+private:
+    int fps;
+    std::thread worker;
+    std::atomic<bool> running;
+
+    // writer owns buffers[write_i], reader owns buffers[read_i], the
+    // third one is handed over through `pending`
+    render_frame buffers[3];
+    std::atomic<int> pending;
+    int write_i;
+    int read_i;
+
+    render_frame shown;
+    bool drawn;
+    std::string out;
+
+    static const int FRESH = 4;
+
+    bool take(void);
+    void draw(const render_frame &frame);
+    void loop(void);
+};
+
+
+renderer::renderer(int _fps /*=RENDER_FPS*/)
+{
+    fps = _fps > 0? _fps: 1;
+    running = false;
+    write_i = 0;
+    pending = 1;
+    read_i = 2;
+    drawn = false;
+    memset(buffers, 0, sizeof(buffers));
+    memset(&shown, 0, sizeof(shown));
+}
+
+renderer::~renderer()
+{
+    stop();
+}
+
+
+void renderer::start(void)
+{
+    if (running)
+    {
+        return;
+    }
+    drawn = false;
+    running = true;
+    worker = std::thread(&renderer::loop, this);
+}
+
+void renderer::stop(void)
+{
+    if (!running)
+    {
+        return;
+    }
+    running = false;
+    worker.join();
+}
+
+
+void renderer::submit(int size, int *const *board, const char *status)
+{
+    render_frame &frame = buffers[write_i];
+    frame.size = size < RENDER_MAX_SIZE? size: RENDER_MAX_SIZE;
+    for (int i = 0; i < frame.size; ++i)
+    {
+        for (int j = 0; j < frame.size; ++j)
+        {
+            frame.cells[i][j] = board[i][j];
+        }
+    }
+    int line = 0;
+    int k = 0;
+    memset(frame.status, 0, sizeof(frame.status));
+    for (const char *p = status; *p && line < RENDER_STATUS_LINES; ++p)
+    {
+        if (*p == '\n')
+        {
+            ++line;
+            k = 0;
+        }
+        else if (k < RENDER_STATUS_LEN - 1)
+        {
+            frame.status[line][k++] = *p;
+        }
+    }
+    write_i = pending.exchange(write_i | FRESH) & 3;
+}
+
+
+bool renderer::take(void)
+{
+    if (!(pending.load() & FRESH))
+    {
+        return false;
+    }
+    read_i = pending.exchange(read_i) & 3;
+    return true;
+}
+
+void renderer::draw(const render_frame &frame)
+{
+    char buf[64];
+    out.clear();
+    bool full = !drawn || frame.size != shown.size;
+    if (full)
+    {
+        out += "\x1b[2J";
+    }
+    for (int i = 0; i < frame.size; ++i)
+    {
+        for (int j = 0; j < frame.size; ++j)
+        {
+            int v = frame.cells[i][j];
+            if (!full && v == shown.cells[i][j])
+            {
+                continue;
+            }
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dH%s%*d\x1b[37m", i + 1, j*RENDER_CELL_WIDE + 1,
+                tile_color(v), RENDER_CELL_WIDE, v? 1 << v: 0);
+            out += buf;
+        }
+    }
+    for (int line = 0; line < RENDER_STATUS_LINES; ++line)
+    {
+        if (!full && !strcmp(frame.status[line], shown.status[line]))
+        {
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[K", frame.size + 2 + line);
+        out += buf;
+        out += frame.status[line];
+    }
+    // park the cursor below and wipe anything echoed there
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[J", frame.size + 2 + RENDER_STATUS_LINES);
+    out += buf;
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    shown = frame;
+    drawn = true;
+}
+
+void renderer::loop(void)
+{
+    std::chrono::microseconds period(1000000 / fps);
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while (running)
+    {
+        if (take())
+        {
+            draw(buffers[read_i]);
+        }
+        next += period;
+        std::this_thread::sleep_until(next);
+    }
+    // the last frame is always shown
+    if (take())
+    {
+        draw(buffers[read_i]);
+    }
+}
+
+
+void game2048::cmd_game(void)
+{
+    renderer screen;
+    char status[RENDER_STATUS_LEN];
+    clear_board();
+    generate_new();
+    char key_down;
+    screen.start();
+    do
+    {
+        generate_new();
+        snprintf(status, sizeof(status), "Score: %5d", score);
+        screen.submit(size, board, status);
+        do
+        {
+            key_down = getchar();
+            if (key_down == 27 || key_down == 26)
+            {
+                screen.stop();
+                return;
+            }
+        }while (opt(key_down) == -1 && !is_dead());
+    }while(get_empty_num());
+    snprintf(status, sizeof(status), "Score: %5d", score);
+    screen.submit(size, board, status);
+    screen.stop();
+    printf("Good Game.\nFinal Score:%d", score);
+}
+
+
+
+#endif
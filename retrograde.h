@@ -0,0 +1,642 @@
+#ifndef RETROGRADE_H
+#define RETROGRADE_H
+
+#include "game2048.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// Exact values of every board reachable on 2x2 and 3x3 games that end
+// at a 2^target tile or when no move is left. A move keeps the tile sum
+// and a spawn adds 2 or 4, so boards fall into layers by tile sum that
+// only lead to higher layers: the layers are enumerated forwards from
+// the opening boards and solved backwards, each layer split over the
+// worker threads.
+
+const int RG_MAX_SIZE = 3;
+const int RG_KEY_BITS = 36; // 4 bits per cell, cell c at bits 4c..
+const int RG_VALUE_BITS = 64 - RG_KEY_BITS;
+const uint64_t RG_VALUE_MASK = (uint64_t(1) << RG_VALUE_BITS) - 1;
+
+// RG_WIN: chance of reaching 2^target
+// RG_SCORE: expected score still to gain, in 1/RG_SCORE_SCALE points
+const int RG_WIN = 0;
+const int RG_SCORE = 1;
+const double RG_SCORE_SCALE = 16;
+
+const char RG_MAGIC[4] = {'R', 'G', 'R', 'D'};
+const uint32_t RG_VERSION = 1;
+
+
+// file layout: header, then count uint64 entries sorted by key, each
+// key << RG_VALUE_BITS | value
+struct rg_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t target;
+    uint32_t mode;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+
+class retrograde
+{
+public:
+    retrograde();
+    ~retrograde();
+
+    // thread_num 0 for one per core; false if the size or target does
+    // not fit the packing
+    bool build(int _size, int _target, int _mode=RG_WIN, int thread_num=0);
+    bool load(const char *filename);
+    bool save(const char *filename) const;
+
+    inline bool ready(void) const;
+    inline int get_size(void) const;
+    inline long long get_count(void) const;
+
+    // value of the board with the player to move, -1 if not reachable
+    double value(const game2048 &game) const;
+    // value after opt_i and the spawn, -1 if opt_i changes nothing
+    double move_value(const game2048 &game, int opt_i) const;
+    // optimal move, -1 if dead or not in the table
+    int best_move(const game2048 &game, double *best_value=NULL) const;
+
+private:
+    int size;
+    int target;
+    int mode;
+    uint16_t line_move[1 << (4*RG_MAX_SIZE)];
+    int line_gain[1 << (4*RG_MAX_SIZE)];
+
+    const uint64_t* entries;
+    uint64_t count;
+    std::vector<uint64_t> owned;
+    void* mapped;
+    size_t mapped_size;
+
+    void release(void);
+    void init_lines(void);
+    inline int cell(uint64_t key, int c) const;
+    inline bool finished(uint64_t key) const;
+    uint64_t pack(const game2048 &game) const;
+    int move(uint64_t key, int opt_i, uint64_t &after) const;
+    double lookup(uint64_t key) const;
+    double decode(uint64_t value) const;
+    uint64_t encode(double value) const;
+
+    // expected value of the spawn after an afterstate
+    template <typename F>
+    double spawn_value(uint64_t after, F get) const;
+
+    struct layer
+    {
+        std::vector<uint64_t> keys;
+        std::vector<double> values;
+    };
+    double layer_value(const std::vector<layer> &layers, int l, uint64_t key) const;
+    void expand(const std::vector<uint64_t> &keys, size_t from, size_t to,
+        std::vector<uint64_t> *next) const;
+    void solve_range(std::vector<layer> &layers, int l, size_t from, size_t to) const;
+    void flush(layer &solved);
+};
+
+
+retrograde::retrograde()
+{
+    size = 0;
+    target = 0;
+    mode = RG_WIN;
+    entries = NULL;
+    count = 0;
+    mapped = NULL;
+    mapped_size = 0;
+}
+
+retrograde::~retrograde()
+{
+    release();
+}
+
+
+void retrograde::release(void)
+{
+    if (mapped)
+    {
+        munmap(mapped, mapped_size);
+        mapped = NULL;
+    }
+    owned.clear();
+    entries = NULL;
+    count = 0;
+}
+
+// slide results of every line of size cells towards cell 0, same rules
+// as game2048::merge
+void retrograde::init_lines(void)
+{
+    int line_num = 1 << (4*size);
+    for (int x = 0; x < line_num; ++x)
+    {
+        int v[RG_MAX_SIZE];
+        int out[RG_MAX_SIZE] = {0};
+        for (int k = 0; k < size; ++k)
+        {
+            v[k] = x >> (4*k) & 0xf;
+        }
+        int end = 0;
+        int gain = 0;
+        bool merged = false;
+        for (int k = 0; k < size; ++k)
+        {
+            if (!v[k])
+            {
+                continue;
+            }
+            if (end > 0 && !merged && out[end - 1] == v[k] && v[k] < 15)
+            {
+                ++out[end - 1];
+                gain += 1 << out[end - 1];
+                merged = true;
+            }
+            else
+            {
+                out[end++] = v[k];
+                merged = false;
+            }
+        }
+        int y = 0;
+        for (int k = 0; k < size; ++k)
+        {
+            y |= out[k] << (4*k);
+        }
+        line_move[x] = uint16_t(y);
+        line_gain[x] = gain;
+    }
+}
+
+inline int retrograde::cell(uint64_t key, int c) const
+{
+    return int(key >> (4*c) & 0xf);
+}
+
+inline bool retrograde::finished(uint64_t key) const
+{
+    for (int c = 0; c < size*size; ++c)
+    {
+        if (cell(key, c) >= target)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t retrograde::pack(const game2048 &game) const
+{
+    uint64_t key = 0;
+    for (int c = 0; c < size*size; ++c)
+    {
+        int v = game.get(c / size, c % size);
+        if (v > 15)
+        {
+            return ~uint64_t(0);
+        }
+        key |= uint64_t(v) << (4*c);
+    }
+    return key;
+}
+
+// gain of opt_i, -1 if it changes nothing
+int retrograde::move(uint64_t key, int opt_i, uint64_t &after) const
+{
+    after = 0;
+    int gain = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        // cells of line i, from the side the tiles move towards
+        int c[RG_MAX_SIZE];
+        for (int k = 0; k < size; ++k)
+        {
+            switch (opt_i)
+            {
+            case 0: c[k] = k*size + i; break;
+            case 1: c[k] = i*size + size - 1 - k; break;
+            case 2: c[k] = (size - 1 - k)*size + i; break;
+            default: c[k] = i*size + k; break;
+            }
+        }
+        int x = 0;
+        for (int k = 0; k < size; ++k)
+        {
+            x |= cell(key, c[k]) << (4*k);
+        }
+        int y = line_move[x];
+        gain += line_gain[x];
+        for (int k = 0; k < size; ++k)
+        {
+            after |= uint64_t(y >> (4*k) & 0xf) << (4*c[k]);
+        }
+    }
+    return after == key? -1: gain;
+}
+
+template <typename F>
+double retrograde::spawn_value(uint64_t after, F get) const
+{
+    double sum = 0;
+    int empty_num = 0;
+    for (int c = 0; c < size*size; ++c)
+    {
+        if (!cell(after, c))
+        {
+            sum += 0.9*get(after | uint64_t(1) << (4*c)) + 0.1*get(after | uint64_t(2) << (4*c));
+            ++empty_num;
+        }
+    }
+    return empty_num? sum/empty_num: 0;
+}
+
+
+double retrograde::decode(uint64_t value) const
+{
+    if (mode == RG_WIN)
+    {
+        return double(value)/RG_VALUE_MASK;
+    }
+    return value/RG_SCORE_SCALE;
+}
+
+uint64_t retrograde::encode(double value) const
+{
+    double x = mode == RG_WIN? value*RG_VALUE_MASK: value*RG_SCORE_SCALE;
+    x = std::min(std::max(x + 0.5, 0.0), double(RG_VALUE_MASK));
+    return uint64_t(x);
+}
+
+double retrograde::lookup(uint64_t key) const
+{
+    uint64_t probe = key << RG_VALUE_BITS;
+    const uint64_t *p = std::lower_bound(entries, entries + count, probe);
+    if (p == entries + count || (*p >> RG_VALUE_BITS) != key)
+    {
+        return -1;
+    }
+    return decode(*p & RG_VALUE_MASK);
+}
+
+
+inline bool retrograde::ready(void) const
+{
+    return entries != NULL;
+}
+
+inline int retrograde::get_size(void) const
+{
+    return size;
+}
+
+inline long long retrograde::get_count(void) const
+{
+    return count;
+}
+
+
+double retrograde::value(const game2048 &game) const
+{
+    if (!ready() || game.get_size() != size)
+    {
+        return -1;
+    }
+    return lookup(pack(game));
+}
+
+double retrograde::move_value(const game2048 &game, int opt_i) const
+{
+    if (!ready() || game.get_size() != size)
+    {
+        return -1;
+    }
+    uint64_t after;
+    int gain = move(pack(game), opt_i, after);
+    if (gain < 0)
+    {
+        return -1;
+    }
+    if (finished(after))
+    {
+        return mode == RG_WIN? 1: gain;
+    }
+    double v = spawn_value(after, [this](uint64_t k) { return std::max(lookup(k), 0.0); });
+    return mode == RG_SCORE? v + gain: v;
+}
+
+int retrograde::best_move(const game2048 &game, double *best_value /*=NULL*/) const
+{
+    int best = -1;
+    double best_v = 0;
+    // lookups of boards after a move off the table only miss, and
+    // would all count as 0
+    if (value(game) < 0)
+    {
+        return -1;
+    }
+    for (int opt_i = 0; opt_i < 4; ++opt_i)
+    {
+        double v = move_value(game, opt_i);
+        if (v >= 0 && (best < 0 || v > best_v))
+        {
+            best = opt_i;
+            best_v = v;
+        }
+    }
+    if (best_value)
+    {
+        *best_value = best_v;
+    }
+    return best;
+}
+
+
+// layers are numbered by tile sum / 2
+double retrograde::layer_value(const std::vector<layer> &layers, int l, uint64_t key) const
+{
+    const std::vector<uint64_t> &keys = layers[l].keys;
+    size_t i = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    return layers[l].values[i];
+}
+
+// boards one spawn after keys[from, to): next[0] one layer up, next[1]
+// two layers up
+void retrograde::expand(const std::vector<uint64_t> &keys, size_t from, size_t to,
+    std::vector<uint64_t> *next) const
+{
+    for (size_t i = from; i < to; ++i)
+    {
+        if (finished(keys[i]))
+        {
+            continue;
+        }
+        for (int opt_i = 0; opt_i < 4; ++opt_i)
+        {
+            uint64_t after;
+            if (move(keys[i], opt_i, after) < 0 || finished(after))
+            {
+                continue;
+            }
+            for (int c = 0; c < size*size; ++c)
+            {
+                if (!cell(after, c))
+                {
+                    next[0].push_back(after | uint64_t(1) << (4*c));
+                    next[1].push_back(after | uint64_t(2) << (4*c));
+                }
+            }
+        }
+    }
+}
+
+void retrograde::solve_range(std::vector<layer> &layers, int l, size_t from, size_t to) const
+{
+    layer &cur = layers[l];
+    for (size_t i = from; i < to; ++i)
+    {
+        uint64_t key = cur.keys[i];
+        if (finished(key))
+        {
+            cur.values[i] = mode == RG_WIN? 1: 0;
+            continue;
+        }
+        double best = 0;
+        for (int opt_i = 0; opt_i < 4; ++opt_i)
+        {
+            uint64_t after;
+            int gain = move(key, opt_i, after);
+            if (gain < 0)
+            {
+                continue;
+            }
+            double v;
+            if (finished(after))
+            {
+                v = mode == RG_WIN? 1: gain;
+            }
+            else
+            {
+                v = spawn_value(after, [&](uint64_t k)
+                {
+                    int n = 0;
+                    for (int c = 0; c < size*size; ++c)
+                    {
+                        n += cell(k, c)? 1 << (cell(k, c) - 1): 0;
+                    }
+                    return layer_value(layers, n, k);
+                });
+                v += mode == RG_SCORE? gain: 0;
+            }
+            best = std::max(best, v);
+        }
+        cur.values[i] = best;
+    }
+}
+
+
+// moves a solved layer into the packed entries
+void retrograde::flush(layer &solved)
+{
+    for (size_t i = 0; i < solved.keys.size(); ++i)
+    {
+        owned.push_back(solved.keys[i] << RG_VALUE_BITS | encode(solved.values[i]));
+    }
+    std::vector<uint64_t>().swap(solved.keys);
+    std::vector<double>().swap(solved.values);
+}
+
+
+bool retrograde::build(int _size, int _target, int _mode /*=RG_WIN*/, int thread_num /*=0*/)
+{
+    if (_size < 2 || _size > RG_MAX_SIZE || _target < 2 || _target > 15)
+    {
+        return false;
+    }
+    if (thread_num <= 0)
+    {
+        thread_num = std::thread::hardware_concurrency();
+        thread_num = thread_num > 0? thread_num: 1;
+    }
+    release();
+    size = _size;
+    target = _target;
+    mode = _mode;
+    init_lines();
+
+    // openings: two spawns on an empty board
+    std::vector<layer> layers(5);
+    for (int a = 0; a < size*size; ++a)
+    {
+        for (int b = a + 1; b < size*size; ++b)
+        {
+            for (int va = 1; va <= 2; ++va)
+            {
+                for (int vb = 1; vb <= 2; ++vb)
+                {
+                    uint64_t key = uint64_t(va) << (4*a) | uint64_t(vb) << (4*b);
+                    layers[(1 << (va - 1)) + (1 << (vb - 1))].keys.push_back(key);
+                }
+            }
+        }
+    }
+
+    // forwards: layer l is complete once l - 1 and l - 2 are expanded
+    for (size_t l = 0; l < layers.size(); ++l)
+    {
+        std::vector<uint64_t> &keys = layers[l].keys;
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        if (keys.empty())
+        {
+            continue;
+        }
+        std::vector<std::vector<uint64_t> > next(thread_num*2);
+        std::vector<std::thread> workers;
+        size_t per_thread = (keys.size() + thread_num - 1) / thread_num;
+        for (int t = 0; t < thread_num; ++t)
+        {
+            size_t from = std::min(keys.size(), t*per_thread);
+            size_t to = std::min(keys.size(), from + per_thread);
+            workers.push_back(std::thread(&retrograde::expand, this,
+                std::cref(keys), from, to, &next[t*2]));
+        }
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers[t].join();
+        }
+        if (layers.size() < l + 3)
+        {
+            layers.resize(l + 3);
+        }
+        for (int t = 0; t < thread_num; ++t)
+        {
+            for (int k = 0; k < 2; ++k)
+            {
+                std::vector<uint64_t> &dst = layers[l + 1 + k].keys;
+                dst.insert(dst.end(), next[t*2 + k].begin(), next[t*2 + k].end());
+            }
+        }
+    }
+
+    // backwards: every layer only reads the two above it
+    size_t total = 0;
+    for (size_t l = 0; l < layers.size(); ++l)
+    {
+        total += layers[l].keys.size();
+    }
+    owned.reserve(total);
+    for (int l = int(layers.size()) - 1; l >= 0; --l)
+    {
+        layers[l].values.resize(layers[l].keys.size());
+        size_t n = layers[l].keys.size();
+        std::vector<std::thread> workers;
+        size_t per_thread = (n + thread_num - 1) / thread_num;
+        for (int t = 0; t < thread_num; ++t)
+        {
+            size_t from = std::min(n, t*per_thread);
+            size_t to = std::min(n, from + per_thread);
+            workers.push_back(std::thread(&retrograde::solve_range, this,
+                std::ref(layers), l, from, to));
+        }
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers[t].join();
+        }
+        if (l + 2 < int(layers.size()))
+        {
+            // nothing reads two layers up any more
+            flush(layers[l + 2]);
+        }
+    }
+    for (int l = 0; l < 2 && l < int(layers.size()); ++l)
+    {
+        flush(layers[l]);
+    }
+    std::sort(owned.begin(), owned.end());
+    entries = owned.data();
+    count = owned.size();
+    return true;
+}
+
+
+bool retrograde::load(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || size_t(st.st_size) < sizeof(rg_header))
+    {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+    const rg_header *h = (const rg_header*)p;
+    if (memcmp(h->magic, RG_MAGIC, 4) || h->version != RG_VERSION ||
+        h->size < 2 || h->size > uint32_t(RG_MAX_SIZE) || h->target > 15 ||
+        sizeof(rg_header) + h->count*sizeof(uint64_t) != size_t(st.st_size))
+    {
+        munmap(p, st.st_size);
+        return false;
+    }
+    release();
+    size = h->size;
+    target = h->target;
+    mode = h->mode;
+    init_lines();
+    mapped = p;
+    mapped_size = st.st_size;
+    entries = (const uint64_t*)((const char*)p + sizeof(rg_header));
+    count = h->count;
+    return true;
+}
+
+bool retrograde::save(const char *filename) const
+{
+    rg_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RG_MAGIC, 4);
+    h.version = RG_VERSION;
+    h.size = size;
+    h.target = target;
+    h.mode = mode;
+    h.count = count;
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, file) == 1 &&
+        fwrite(entries, sizeof(uint64_t), count, file) == count;
+    return fclose(file) == 0 && ok;
+}
+
+
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef ROWTABLE_H
+#define ROWTABLE_H
+
+#include "game2048.h"
+#include "solver.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// ROW_TABLE from a file built once by `main rows [path]` and mapped
+// read-only, so every process on the machine shares its pages. The path
+// is $ROWS_FILE, else rows.bin in the working directory. Other modes
+// never write it: a missing file, or one whose header does not match
+// this build (version, line shape, entry layout, evaluater feature set,
+// checksum), is built in memory for that process alone.
+
+const char ROW_MAGIC[4] = {'R', 'O', 'W', 'T'};
+const uint32_t ROW_VERSION = 2;
+const char ROW_TABLE_FILE[] = "rows.bin";
+const char ROW_TABLE_ENV[] = "ROWS_FILE";
+
+// file layout: the header, then ROW_NUM entries
+struct row_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t line_len;
+    uint32_t values;
+    uint32_t entry_size;
+    uint32_t entry_num;
+    uint32_t feature_num; // evaluater::FEATURE_NUM the features serve
+    uint32_t reserved;
+    uint64_t checksum; // FNV-1a of the entries
+};
+
+
+namespace rows
+{
+    row_entry *owned = NULL;
+    void *mapped = NULL;
+    size_t mapped_size = 0;
+
+    uint64_t checksum(const void *data, size_t n)
+    {
+        const unsigned char *p = (const unsigned char*)data;
+        uint64_t h = 1469598103934665603ULL;
+        for (size_t k = 0; k < n; ++k)
+        {
+            h = (h ^ p[k])*1099511628211ULL;
+        }
+        return h;
+    }
+
+    void header_of(row_header &h, const row_entry *table)
+    {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, ROW_MAGIC, 4);
+        h.version = ROW_VERSION;
+        h.line_len = ROW_LEN;
+        h.values = ROW_VALUES;
+        h.entry_size = sizeof(row_entry);
+        h.entry_num = ROW_NUM;
+        h.feature_num = evaluater::FEATURE_NUM;
+        h.checksum = table? checksum(table, sizeof(row_entry)*ROW_NUM): 0;
+    }
+
+    // with ROW_TABLE unset, so moves and features come from the loops
+    void build(row_entry *table)
+    {
+        memset(table, 0, sizeof(row_entry)*ROW_NUM);
+        game2048 line(ROW_LEN);
+        int cells[ROW_LEN];
+        const int *line_cells[1] = {cells};
+        for (int key = 0; key < ROW_NUM; ++key)
+        {
+            row_entry &e = table[key];
+            line.clear_board();
+            for (int k = 0; k < ROW_LEN; ++k)
+            {
+                cells[k] = key >> (4*k) & 0xf;
+                line.set(0, k, cells[k]);
+            }
+            line_features f;
+            game2048::line_scan(line_cells, 0, 0, 0, 1, ROW_LEN, f);
+            e.empty_num = int8_t(f.empty_num);
+            e.max_val = int8_t(f.max_val);
+            e.merge = int8_t(f.merge);
+            e.mono = int8_t(f.mono);
+            for (int k = 0; k < 2; ++k)
+            {
+                e.diff[k] = int8_t(f.diff[k]);
+                e.zero[k] = int8_t(f.zero[k]);
+                e.step[k] = int8_t(f.step[k]);
+            }
+            int gain = line.opt(3);
+            e.gain = gain > 0? gain: 0;
+            e.moved = 0;
+            for (int k = 0; k < ROW_LEN; ++k)
+            {
+                int v = line.get(0, k);
+                if (v >= ROW_VALUES)
+                {
+                    e.flags |= ROW_OVERFLOW;
+                }
+                e.moved |= uint16_t((v & 0xf) << (4*k));
+            }
+        }
+    }
+
+    void release(void)
+    {
+        ROW_TABLE = NULL;
+        delete []owned;
+        owned = NULL;
+        if (mapped)
+        {
+            munmap(mapped, mapped_size);
+            mapped = NULL;
+        }
+    }
+
+    // maps filename if its header and checksum match this build
+    bool map_file(const char *filename)
+    {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        size_t size = sizeof(row_header) + sizeof(row_entry)*ROW_NUM;
+        if (fstat(fd, &st) || size_t(st.st_size) != size)
+        {
+            close(fd);
+            return false;
+        }
+        void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            return false;
+        }
+        const row_header *h = (const row_header*)p;
+        const row_entry *table = (const row_entry*)((const char*)p + sizeof(row_header));
+        row_header want;
+        header_of(want, NULL);
+        want.checksum = h->checksum;
+        if (memcmp(h, &want, sizeof(want)) ||
+            h->checksum != checksum(table, sizeof(row_entry)*ROW_NUM))
+        {
+            munmap(p, size);
+            return false;
+        }
+        release();
+        mapped = p;
+        mapped_size = size;
+        ROW_TABLE = table;
+        return true;
+    }
+
+    // written under a temporary name and renamed, so processes starting
+    // meanwhile never map a half-written file
+    bool save(const char *filename, const row_entry *table)
+    {
+        row_header h;
+        header_of(h, table);
+        char tmp[256];
+        snprintf(tmp, sizeof(tmp), "%s.%d", filename, int(getpid()));
+        FILE *file = fopen(tmp, "wb");
+        if (!file)
+        {
+            return false;
+        }
+        bool ok = fwrite(&h, sizeof(h), 1, file) == 1 &&
+            fwrite(table, sizeof(row_entry), ROW_NUM, file) == size_t(ROW_NUM);
+        ok = !fclose(file) && ok;
+        if (!ok || rename(tmp, filename))
+        {
+            remove(tmp);
+            return false;
+        }
+        return true;
+    }
+
+    // $ROWS_FILE, else ROW_TABLE_FILE
+    const char *default_path(void)
+    {
+        const char *path = getenv(ROW_TABLE_ENV);
+        return path && *path? path: ROW_TABLE_FILE;
+    }
+
+    // sets ROW_TABLE from filename, or builds it in this process when
+    // the file is missing or stale; never writes the file. Call before
+    // any search thread starts.
+    void load(const char *filename=NULL)
+    {
+        if (map_file(filename? filename: default_path()))
+        {
+            return;
+        }
+        release();
+        owned = new row_entry [ROW_NUM];
+        build(owned);
+        ROW_TABLE = owned;
+    }
+
+    // builds and writes filename, then maps it; false when it cannot be
+    // written, the table then stays in this process
+    bool install(const char *filename=NULL)
+    {
+        if (!filename)
+        {
+            filename = default_path();
+        }
+        release();
+        row_entry *table = new row_entry [ROW_NUM];
+        build(table);
+        if (save(filename, table) && map_file(filename))
+        {
+            delete []table;
+            return true;
+        }
+        owned = table;
+        ROW_TABLE = owned;
+        return false;
+    }
+}
+
+
+
+#endif
@@ -0,0 +1,339 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "game2048.h"
+#include "solver.h"
+#include "symmetry.h"
+#include "ponder.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <csignal>
+#include <chrono>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+// Long-lived solver process. Requests come one per line:
+//     <size> <score> <cells...>   board as in log_to_file, one line
+//     new                         forget cached search results
+//     stats                       request count and latency so far
+//     quit
+// and are answered with one line each:
+//     <move> <value> <nodes> <latency_us>
+// move is 0 up, 1 right, 2 down, 3 left, -1 for a board with no move
+// (dead or empty); nodes is the rollout count for the Monte Carlo
+// engine. A malformed request is answered "error <reason>".
+// 4x4 boards may instead be sent as a 13-byte frame: SERVICE_FRAME,
+// the board packed as by sym_pack (cell (i, j) in bits 60-4(i*4+j)..,
+// so (0, 0) is the high nibble) as uint64, the score as uint32, both
+// little endian. The answer is a 14-byte frame:
+// SERVICE_FRAME, int8 move, float value, uint32 nodes, uint32 latency_us.
+// Everything already received is answered before the output is flushed,
+// so clients can pipeline requests. While waiting for the next request
+// the service ponders the board its last answer leads to (PONDER).
+
+const unsigned char SERVICE_FRAME = 0xb2;
+const int SERVICE_FRAME_LEN = 13;
+const int SERVICE_MAX_SIZE = 8;
+// cells are exponents 0 <= v < SERVICE_MAX_VAL, so merging any two
+// still fits 1 << v in an int (and v in an undo_token)
+const int SERVICE_MAX_VAL = 31;
+const int SERVICE_BUFFER_SIZE = 1 << 16;
+
+
+namespace service
+{
+    long long request_count;
+    double latency_sum;
+    double latency_max;
+
+    game2048* boards[SERVICE_MAX_SIZE + 1];
+
+    bool PONDER = true;
+    ponderer pondering;
+    // the last answered board after its move, NULL if it had none
+    game2048 *after = NULL;
+
+    game2048& get_board(int size)
+    {
+        if (!boards[size])
+        {
+            boards[size] = new game2048(size);
+        }
+        return *boards[size];
+    }
+
+    // solves and records the latency since start_t in microseconds
+    int answer(const game2048 &game, std::chrono::steady_clock::time_point start_t, double &us)
+    {
+        int opt_i = -1;
+        solver::node_count = 0;
+        solver::last_value = 0;
+        if (game.get_move_mask())
+        {
+            if (PONDER)
+            {
+                pondering.hit(game);
+            }
+            opt_i = solver::solve(game);
+            pondering.stop();
+        }
+        us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start_t).count();
+        delete after;
+        after = NULL;
+        if (opt_i >= 0)
+        {
+            after = new game2048(game);
+            after->opt(opt_i);
+        }
+        ++request_count;
+        latency_sum += us;
+        renew_max(latency_max, us);
+        return opt_i;
+    }
+
+    // line starts with the whole word cmd
+    inline bool is_command(const char *line, const char *cmd)
+    {
+        size_t n = strlen(cmd);
+        return !strncmp(line, cmd, n) && (!line[n] || line[n] == ' ' || line[n] == '\t');
+    }
+
+    // false on quit
+    bool handle_line(const char *line, std::string &out)
+    {
+        std::chrono::steady_clock::time_point start_t = std::chrono::steady_clock::now();
+        char buf[128];
+        while (*line == ' ' || *line == '\t')
+        {
+            ++line;
+        }
+        if (!*line)
+        {
+            return true;
+        }
+        if (is_command(line, "quit"))
+        {
+            return false;
+        }
+        if (is_command(line, "new"))
+        {
+            pondering.stop();
+            solver::table.clear();
+            out += "ok\n";
+            return true;
+        }
+        if (is_command(line, "stats"))
+        {
+            snprintf(buf, sizeof(buf), "requests %lld mean_us %.1lf max_us %.1lf\n",
+                request_count, request_count? latency_sum/request_count: 0, latency_max);
+            out += buf;
+            return true;
+        }
+        if ((*line >= 'a' && *line <= 'z') || (*line >= 'A' && *line <= 'Z'))
+        {
+            out += "error unknown command\n";
+            return true;
+        }
+        char *end;
+        long size = strtol(line, &end, 10);
+        if (end == line || size < 2 || size > SERVICE_MAX_SIZE)
+        {
+            out += "error bad size\n";
+            return true;
+        }
+        line = end;
+        long score = strtol(line, &end, 10);
+        game2048 &game = get_board(int(size));
+        game.set_score(int(score));
+        bool bad_cell = false;
+        for (int c = 0; end != line && c < size*size; ++c)
+        {
+            line = end;
+            long v = strtol(line, &end, 10);
+            bad_cell |= v < 0 || v >= SERVICE_MAX_VAL;
+            game.set(c / size, c % size, bad_cell? 0: int(v));
+        }
+        if (end == line)
+        {
+            out += "error missing cells\n";
+            return true;
+        }
+        if (bad_cell)
+        {
+            out += "error bad cell\n";
+            return true;
+        }
+        double us;
+        int opt_i = answer(game, start_t, us);
+        snprintf(buf, sizeof(buf), "%d %.4lf %lld %.0lf\n",
+            opt_i, solver::last_value, solver::node_count, us);
+        out += buf;
+        return true;
+    }
+
+    void handle_frame(const unsigned char *frame, std::string &out)
+    {
+        std::chrono::steady_clock::time_point start_t = std::chrono::steady_clock::now();
+        uint64_t packed = 0;
+        uint32_t score = 0;
+        for (int k = 0; k < 8; ++k)
+        {
+            packed |= uint64_t(frame[1 + k]) << (8*k);
+        }
+        for (int k = 0; k < 4; ++k)
+        {
+            score |= uint32_t(frame[9 + k]) << (8*k);
+        }
+        game2048 &game = get_board(4);
+        game.set_score(int(score));
+        sym_unpack(packed, game);
+        double us;
+        int opt_i = answer(game, start_t, us);
+        float value = float(solver::last_value);
+        uint32_t nodes = uint32_t(solver::node_count);
+        uint32_t latency = uint32_t(us);
+        unsigned char reply[14];
+        reply[0] = SERVICE_FRAME;
+        reply[1] = (unsigned char)(int8_t(opt_i));
+        memcpy(reply + 2, &value, 4);
+        for (int k = 0; k < 4; ++k)
+        {
+            reply[6 + k] = (unsigned char)(nodes >> (8*k));
+            reply[10 + k] = (unsigned char)(latency >> (8*k));
+        }
+        out.append((const char*)reply, sizeof(reply));
+    }
+
+    bool write_all(int fd, const std::string &out)
+    {
+        size_t done = 0;
+        while (done < out.size())
+        {
+            ssize_t n = write(fd, out.data() + done, out.size() - done);
+            if (n <= 0)
+            {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    void run_loop(int in_fd, int out_fd);
+
+    // serves requests from in_fd until quit or end of input
+    void run(int in_fd=0, int out_fd=1)
+    {
+        run_loop(in_fd, out_fd);
+        pondering.stop();
+        delete after;
+        after = NULL;
+    }
+
+    void run_loop(int in_fd, int out_fd)
+    {
+        std::string in;
+        std::string out;
+        char buf[SERVICE_BUFFER_SIZE];
+        bool quit = false;
+        while (!quit)
+        {
+            size_t pos = 0;
+            while (pos < in.size())
+            {
+                if ((unsigned char)in[pos] == SERVICE_FRAME)
+                {
+                    if (in.size() - pos < size_t(SERVICE_FRAME_LEN))
+                    {
+                        break;
+                    }
+                    handle_frame((const unsigned char*)in.data() + pos, out);
+                    pos += SERVICE_FRAME_LEN;
+                    continue;
+                }
+                size_t nl = in.find('\n', pos);
+                if (nl == std::string::npos)
+                {
+                    break;
+                }
+                in[nl] = '\0';
+                if (nl > pos && in[nl - 1] == '\r')
+                {
+                    in[nl - 1] = '\0';
+                }
+                quit = !handle_line(in.c_str() + pos, out);
+                pos = nl + 1;
+                if (quit)
+                {
+                    break;
+                }
+            }
+            in.erase(0, pos);
+            if (!write_all(out_fd, out))
+            {
+                return;
+            }
+            out.clear();
+            if (quit)
+            {
+                return;
+            }
+            if (PONDER && after && in.empty())
+            {
+                // stopped by the next answer
+                pondering.start(*after);
+            }
+            ssize_t n = read(in_fd, buf, sizeof(buf));
+            if (n <= 0)
+            {
+                return;
+            }
+            in.append(buf, n);
+        }
+    }
+
+    // serves one client at a time on a unix socket; tables and the
+    // transposition table stay warm across connections
+    int serve_socket(const char *path)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            perror("socket");
+            return 1;
+        }
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        if (bind(fd, (sockaddr*)&addr, sizeof(addr)) || listen(fd, 16))
+        {
+            perror("bind");
+            close(fd);
+            return 1;
+        }
+        while (true)
+        {
+            int client = accept(fd, NULL, NULL);
+            if (client < 0)
+            {
+                continue;
+            }
+            run(client, client);
+            close(client);
+        }
+        return 0;
+    }
+}
+
+
+
+#endif
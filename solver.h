@@ -2,9 +2,20 @@
 #define SLOVER_H
 
 #include "game2048.h"
+#include "transposition.h"
+#include "montecarlo.h"
+#include "ntuple.h"
+#include "retrograde.h"
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 template <typename T>
@@ -37,15 +48,6 @@ inline double get_array_max(double *start_p, double *end_p)
 }
 
 
-inline void clear_array(double *start_p, double *end_p)
-{
-    for (double *p = start_p + 1; p < end_p; ++p)
-    {
-        *p = 0;
-    }
-}
-
-
 namespace evaluater
 {
     // evaluation config
@@ -56,23 +58,41 @@ namespace evaluater
     // double SVK1 = 0.945188;// 0.896329;
     // double SVK2 = -0.488449;// 1.0619;
 
+    // feature vector scored by eval(); the first three are the old
+    // empty / max / smooth terms
+    const int FEATURE_EMPTY = 0;
+    const int FEATURE_MAX = 1;
+    const int FEATURE_SMOOTH = 2;
+    const int FEATURE_MERGE = 3;
+    const int FEATURE_CORNER = 4; // max tile when it sits in a corner
+    const int FEATURE_MONO = 5; // rows, columns, as in board_features
+    const int FEATURE_NUM = 7;
+    const int FEATURE_PAD = 8; // multiple of 4 for dot()
+
+    // per thread, so optimizer workers can each score their own set
     // 2: 
-    double EMPTY_WEIGHT = 20.3934;
-    double MAXVAL_WEIGHT = 16.4807;
-    double SMOOTH_WEIGHT = 15.2707;
+    thread_local double WEIGHTS[FEATURE_PAD] = {20.3934, 16.4807, 15.2707};
 
-    double SVK1 = 0.928479;
-    double SVK2 = -0.0285195;
-    double smooth_val[5];
+    thread_local double SVK1 = 0.928479;
+    thread_local double SVK2 = -0.0285195;
 
     const int x_step[4] = {0, 0, 1, -1};
     const int y_step[4] = {1, -1, 0, 0};
 
     void set_weight(double w1, double w2, double w3)
     {
-        EMPTY_WEIGHT = w1;
-        MAXVAL_WEIGHT = w2;
-        SMOOTH_WEIGHT = w3;
+        WEIGHTS[FEATURE_EMPTY] = w1;
+        WEIGHTS[FEATURE_MAX] = w2;
+        WEIGHTS[FEATURE_SMOOTH] = w3;
+    }
+
+    // weights past n are zero
+    void set_weights(const double *w, int n)
+    {
+        for (int k = 0; k < FEATURE_PAD; ++k)
+        {
+            WEIGHTS[k] = k < n && k < FEATURE_NUM? w[k]: 0;
+        }
     }
 
     void set_svk(double svk1, double svk2)
@@ -81,43 +101,80 @@ namespace evaluater
         SVK2 = svk2;
     }
 
+    // trained n-tuple network, replaces the formula below on 4x4 boards
+    ntuple_net *NET = NULL;
+
+    void set_ntuple(ntuple_net *net)
+    {
+        NET = net;
+    }
 
+
+    // best directional smoothness, from the board's feature sums
     double get_smooth_val(const game2048 &node)
     {
-        clear_array(smooth_val, smooth_val + 4);
-        register int x, y;
-        for (register int i = 0; i < node.get_size(); ++i)
+        const board_features &f = node.get_features();
+        double smooth_val[4];
+        for (int k = 0; k < 4; ++k)
         {
-            for (register int j = 0; j < node.get_size(); ++j)
-            {
-                for (register int k = 0; k < 4; ++k)
-                {
-                    x = i + x_step[k];
-                    y = j + y_step[k];
-                    if (node.in_board(x, y) && node.get(i, j) > node.get(x, y))
-                    {   
-                        smooth_val[k] -= node.get(x, y)
-                        ? (node.get(i, j) - node.get(x, y))
-                        : SVK1;
-                    }
-                    else if (node.in_board(x, y) && node.get(i, j) + 1 == node.get(x, y))
-                    {
-                        smooth_val[k] += SVK2;
-                    }
-                }
-            }
+            smooth_val[k] = -f.diff[k] - SVK1*f.zero[k] + SVK2*f.step[k];
         }
         return get_array_max(smooth_val, smooth_val + 4);
     }
 
+    // all features from the incrementally kept line sums, no board walk
+    // beyond the four corners
+    void get_feature_vector(const game2048 &node, double *x)
+    {
+        const board_features &f = node.get_features();
+        int last = node.get_size() - 1;
+        bool corner = node.get(0, 0) == f.max_val || node.get(0, last) == f.max_val ||
+            node.get(last, 0) == f.max_val || node.get(last, last) == f.max_val;
+        x[FEATURE_EMPTY] = f.empty_num;
+        x[FEATURE_MAX] = f.max_val;
+        x[FEATURE_SMOOTH] = get_smooth_val(node);
+        x[FEATURE_MERGE] = f.merge;
+        x[FEATURE_CORNER] = corner? f.max_val: 0;
+        for (int k = 0; k < 2; ++k)
+        {
+            x[FEATURE_MONO + k] = -f.mono[k];
+        }
+        for (int k = FEATURE_NUM; k < FEATURE_PAD; ++k)
+        {
+            x[k] = 0;
+        }
+    }
+
+    // n a multiple of 4
+    inline double dot(const double *x, const double *w, int n)
+    {
+#ifdef __AVX2__
+        __m256d sum = _mm256_setzero_pd();
+        for (int k = 0; k < n; k += 4)
+        {
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(x + k), _mm256_loadu_pd(w + k)));
+        }
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+#else
+        double sum = 0;
+        for (int k = 0; k < n; ++k)
+        {
+            sum += x[k]*w[k];
+        }
+        return sum;
+#endif
+    }
+
     double eval(const game2048 &node)
     {
-        int empty_count = node.get_empty_num();
-        int max_val = node.get_max_val();
-        double smooth_val = get_smooth_val(node);
-        return empty_count*EMPTY_WEIGHT + 
-            max_val*MAXVAL_WEIGHT + 
-            smooth_val*SMOOTH_WEIGHT;
+        if (NET && node.get_size() == 4)
+        {
+            return NET->eval(node);
+        }
+        double x[FEATURE_PAD];
+        get_feature_vector(node, x);
+        return dot(x, WEIGHTS, FEATURE_PAD);
     }
 }
 
@@ -129,63 +186,500 @@ namespace solver
     const bool PC_SIDE = false;
     const int SEARCH_DEPTH = 4;
 
+    // depth policy: SEARCH_DEPTH for every move, or picked per move by
+    // pick_depth() so the estimated node count stays near DEPTH_BUDGET.
+    // Depths are even, a spawn and a move per step.
+    bool ADAPTIVE_DEPTH = false;
+    int DEPTH_MIN = 2;
+    int DEPTH_MAX = 8;
+    // estimated nodes of a depth d search with e empty cells, fitted on
+    // self-play: DEPTH_NODES*(e + 2)*(DEPTH_STEP + DEPTH_STEP_EMPTY*e)^(d/2 - 1)
+    double DEPTH_NODES = 22;
+    double DEPTH_STEP = 11;
+    double DEPTH_STEP_EMPTY = 0.5;
+    double DEPTH_BUDGET = 20000;
+    // no deeper than distinct tile values - DEPTH_DISTINCT_OFFSET, and
+    // DEPTH_MIN while the largest tile is below 2^DEPTH_EASY_MAX
+    int DEPTH_DISTINCT_OFFSET = 2;
+    int DEPTH_EASY_MAX = 7;
+    const int DEPTH_LIMIT = 16;
+
+    // chance nodes: search only the top k spawn cells when selective,
+    // k halves every chance ply down to CHANCE_MIN_K
+    bool SELECTIVE_CHANCE = false;
+    int CHANCE_TOP_K = 6;
+    int CHANCE_MIN_K = 2;
+    const int CHANCE_MAX_CELLS = 64;
+
+    // engine used by solve()
+    const int ENGINE_MINIMAX = 0;
+    const int ENGINE_MONTE_CARLO = 1;
+    int ENGINE = ENGINE_MINIMAX;
+    // exact table answering boards of its size instead of either engine
+    retrograde *EXACT_TABLE = NULL;
+
 
     const double DOUBLE_INF = 1e10;
 
-    double minimax(const game2048 &node, int depth, bool side, double alpha, double beta)
+    // stats of the last solve(), per thread so a background search
+    // keeps its own
+    thread_local long long node_count;
+    thread_local double last_value;
+    thread_local int last_depth;
+
+    // set on threads whose search may be called off; an abandoned
+    // search returns at once and stores nothing
+    thread_local const std::atomic<bool> *abort_flag = NULL;
+
+    inline bool aborted(void)
+    {
+        return abort_flag && abort_flag->load(std::memory_order_relaxed);
+    }
+
+    // moves, nodes and microseconds per search depth since reset, on
+    // this thread
+    thread_local long long depth_moves[DEPTH_LIMIT + 1];
+    thread_local long long depth_nodes[DEPTH_LIMIT + 1];
+    thread_local double depth_us[DEPTH_LIMIT + 1];
+
+    // kept across solve() calls, so the subtrees searched for the last
+    // move seed the next one
+    trans_table table;
+    // table searched on this thread; threads searching independent
+    // games point it at their own
+    thread_local trans_table *TABLE = &table;
+
+    inline int bound_flag(double value, double alpha, double beta)
+    {
+        int selective = SELECTIVE_CHANCE? TT_SELECTIVE: 0;
+        if (value <= alpha)
+        {
+            return TT_UPPER | selective;
+        }
+        return (value >= beta? TT_LOWER: TT_EXACT) | selective;
+    }
+
+    void set_selective(bool selective, int top_k=6, int min_k=2)
+    {
+        SELECTIVE_CHANCE = selective;
+        CHANCE_TOP_K = top_k;
+        CHANCE_MIN_K = min_k;
+    }
+
+    // how much a 2 spawned at (i, j) hurts the player: tiles it sits
+    // next to, more so the larger they are
+    inline int spawn_badness(const game2048 &node, int i, int j)
+    {
+        int badness = 0;
+        for (int k = 0; k < 4; ++k)
+        {
+            int x = i + evaluater::x_step[k];
+            int y = j + evaluater::y_step[k];
+            if (node.in_board(x, y) && node.get(x, y))
+            {
+                badness += node.get(x, y);
+            }
+        }
+        return badness;
+    }
+
+    // empty cells to expand at a chance node, the table's best cell
+    // first; the worst top k for the player only when selective
+    int chance_order(const game2048 &node, int depth, int hint, int *order)
+    {
+        int size = node.get_size();
+        int n = 0;
+        if (hint >= 0 && !node.get(hint / size, hint % size))
+        {
+            order[n++] = hint;
+        }
+        int first = n;
+        for (int c = 0; c < size*size && n < CHANCE_MAX_CELLS; ++c)
+        {
+            if (c != hint && !node.get(c / size, c % size))
+            {
+                order[n++] = c;
+            }
+        }
+        if (!SELECTIVE_CHANCE)
+        {
+            return n;
+        }
+        int k = CHANCE_TOP_K >> ((last_depth - depth) / 2);
+        renew_max(k, CHANCE_MIN_K);
+        if (n <= k)
+        {
+            return n;
+        }
+        int badness[CHANCE_MAX_CELLS];
+        for (int i = first; i < n; ++i)
+        {
+            badness[i] = spawn_badness(node, order[i] / size, order[i] % size);
+        }
+        // partial selection sort of the k - first worst cells
+        for (int i = first; i < k; ++i)
+        {
+            int worst = i;
+            for (int j = i + 1; j < n; ++j)
+            {
+                if (badness[j] > badness[worst])
+                {
+                    worst = j;
+                }
+            }
+            std::swap(order[i], order[worst]);
+            std::swap(badness[i], badness[worst]);
+        }
+        return k;
+    }
+
+    // one minimax node between its children: what minimax() keeps on
+    // its stack, so solve_batch() can hold a stack of them per board and
+    // switch boards between any two nodes
+    struct search_node
+    {
+        int depth;
+        bool side;
+        double alpha;
+        double beta;
+        double alpha0;
+        double beta0;
+        uint64_t key;
+        int sym;
+        int hint;
+        int mask;
+        int best;
+        bool cut;  // no more children to search
+        int k;     // current child: move loop index, or index into order
+        int move;  // move or cell of the current child
+        int spawn; // tile of the current chance child, 0 between cells
+        double spawn_val;
+        int n;
+        int order[CHANCE_MAX_CELLS];
+        undo_token token;
+    };
+
+    // counts the node and settles leaves; otherwise computes its key, so
+    // the caller may prefetch the bucket before node_probe()
+    inline bool node_enter(game2048 &node, search_node &s, int depth, bool side,
+        double alpha, double beta, double &value)
     {
         // player -> max
         // pc -> min
-        if (node.is_dead() || !depth)
+        ++node_count;
+        if (aborted())
         {
-            return evaluater::eval(node);
+            value = 0;
+            return true;
         }
-        if (side == PLAYER_SIDE)
+        if (!depth)
         {
-            for (int opt_i = 0; opt_i < 4; ++opt_i)
+            value = evaluater::eval(node);
+            return true;
+        }
+        // a board with tiles and no move is dead
+        s.mask = node.get_move_mask();
+        if (!s.mask)
+        {
+            value = evaluater::eval(node);
+            return true;
+        }
+        s.depth = depth;
+        s.side = side;
+        s.alpha = s.alpha0 = alpha;
+        s.beta = s.beta0 = beta;
+        s.key = board_key(node, side == PC_SIDE, s.sym);
+        return false;
+    }
+
+    // the table's bound when it settles the node, else the child order
+    inline bool node_probe(const game2048 &node, search_node &s, double &value)
+    {
+        int size = node.get_size();
+        tt_entry entry;
+        const tt_entry *e = TABLE->probe(s.key, entry)? &entry: NULL;
+        s.hint = -1;
+        if (e && e->move >= 0 && e->move < (s.side == PLAYER_SIDE? 4: size*size))
+        {
+            s.hint = s.side == PLAYER_SIDE
+            ? sym_move_inverse(s.sym, e->move)
+            : sym_cell(sym_inverse(s.sym), e->move, size);
+        }
+        // a full-width search takes only the move of a selective entry
+        if (e && e->depth >= s.depth && (SELECTIVE_CHANCE || !(e->flag & TT_SELECTIVE)))
+        {
+            int bound = e->flag & TT_BOUND_MASK;
+            if (bound == TT_EXACT)
+            {
+                value = e->value;
+                return true;
+            }
+            if ((bound == TT_LOWER && e->value >= s.beta) || 
+                (bound == TT_UPPER && e->value <= s.alpha))
+            {
+                value = e->value;
+                return true;
+            }
+        }
+        s.best = -1;
+        s.cut = false;
+        s.spawn = 0;
+        if (s.side == PLAYER_SIDE)
+        {
+            s.k = -2;
+        }
+        else
+        {
+            s.k = -1;
+            s.n = chance_order(node, s.depth, s.hint, s.order);
+        }
+        return false;
+    }
+
+    // steps node down to the next child to search; false once there is
+    // none left
+    inline bool node_next(game2048 &node, search_node &s)
+    {
+        if (s.cut)
+        {
+            return false;
+        }
+        if (s.side == PLAYER_SIDE)
+        {
+            // previous best move first, then the rest in order
+            while (++s.k < 4)
             {
-                game2048 child(node);
-                if (child.opt(opt_i) != -1)
+                int opt_i = s.k < 0? s.hint: s.k;
+                if (opt_i < 0 || (s.k >= 0 && opt_i == s.hint) || !(s.mask >> opt_i & 1))
                 {
-                    renew_max(alpha, minimax(child, depth - 1, PC_SIDE, alpha, beta));
-                    if (beta <= alpha)
-                    {
-                        return alpha;
-                    }
+                    continue;
                 }
+                s.move = opt_i;
+                s.token = node.apply(opt_i);
+                return true;
             }
-            return alpha;
+            return false;
         }
-        else
+        int size = node.get_size();
+        if (s.spawn == 4)
         {
-            for (int i = 0; i < node.get_size(); ++i)
-                for (int j = 0; j < node.get_size(); ++j)
-                    if (!node.get(i, j))
-                    {
-                        game2048 child(node);
-                        child.set(i, j, 2);
-                        double _beta = 0.9*minimax(child, depth - 1, PLAYER_SIDE, alpha, beta);
-                        child.set(i, j, 4);
-                        _beta += 0.1*minimax(child, depth - 1, PLAYER_SIDE, alpha, beta);
-                        renew_min(beta, _beta);
-                        if (beta <= alpha)
-                        {
-                            return beta;
-                        }
-                    }
-            return beta;
+            node.set(s.move / size, s.move % size, 4);
+            return true;
+        }
+        if (++s.k >= s.n)
+        {
+            return false;
+        }
+        s.move = s.order[s.k];
+        s.spawn = 2;
+        s.token = node.spawn(s.move / size, s.move % size, 2);
+        return true;
+    }
+
+    // takes the value of the child node_next() stepped to, and steps
+    // node back up
+    inline void node_child(game2048 &node, search_node &s, double val)
+    {
+        if (s.side == PLAYER_SIDE)
+        {
+            node.undo(s.token);
+            if (val > s.alpha)
+            {
+                s.alpha = val;
+                s.best = s.move;
+            }
+            s.cut = s.beta <= s.alpha;
+            return;
+        }
+        if (s.spawn == 2)
+        {
+            s.spawn_val = 0.9*val;
+            s.spawn = 4;
+            return;
+        }
+        s.spawn_val += 0.1*val;
+        s.spawn = 0;
+        node.undo(s.token);
+        if (s.spawn_val < s.beta)
+        {
+            s.beta = s.spawn_val;
+            s.best = s.move;
+        }
+        s.cut = s.beta <= s.alpha;
+    }
+
+    // stores the node and returns its value
+    inline double node_close(const game2048 &node, search_node &s)
+    {
+        if (aborted())
+        {
+            return 0;
+        }
+        s.best = s.best < 0? s.hint: s.best;
+        if (s.side == PLAYER_SIDE)
+        {
+            TABLE->store(s.key, s.depth, s.alpha, bound_flag(s.alpha, s.alpha0, s.beta0),
+                s.best < 0? -1: sym_move(s.sym, s.best));
+            return s.alpha;
+        }
+        TABLE->store(s.key, s.depth, s.beta, bound_flag(s.beta, s.alpha0, s.beta0),
+            s.best < 0? -1: sym_cell(s.sym, s.best, node.get_size()));
+        return s.beta;
+    }
+
+    // node is changed while searching and restored before returning
+    double minimax(game2048 &node, int depth, bool side, double alpha, double beta)
+    {
+        search_node s;
+        double value;
+        if (node_enter(node, s, depth, side, alpha, beta, value) || node_probe(node, s, value))
+        {
+            return value;
+        }
+        while (node_next(node, s))
+        {
+            node_child(node, s, minimax(node, s.depth - 1, !s.side, s.alpha, s.beta));
+        }
+        return node_close(node, s);
+    }
+
+    void set_engine(int engine)
+    {
+        ENGINE = engine;
+    }
+
+    void set_exact(retrograde *exact)
+    {
+        EXACT_TABLE = exact;
+    }
+
+    void set_depth(bool adaptive, double budget=20000, int depth_min=2, int depth_max=8)
+    {
+        ADAPTIVE_DEPTH = adaptive;
+        DEPTH_BUDGET = budget;
+        // both within the depth_* stats, DEPTH_MIN <= DEPTH_MAX
+        DEPTH_MAX = std::max(1, std::min(depth_max, DEPTH_LIMIT));
+        DEPTH_MIN = std::max(1, std::min(depth_min, DEPTH_MAX));
+    }
+
+    // number of different tile values on the board
+    int distinct_num(const game2048 &node)
+    {
+        uint32_t seen = 0;
+        for (int i = 0; i < node.get_size(); ++i)
+        {
+            for (int j = 0; j < node.get_size(); ++j)
+            {
+                seen |= 1u << (node.get(i, j) & 31);
+            }
+        }
+        return __builtin_popcount(seen & ~1u);
+    }
+
+    // deepest depth within DEPTH_BUDGET that the board is complex
+    // enough to need
+    int pick_depth(const game2048 &game)
+    {
+        if (!ADAPTIVE_DEPTH)
+        {
+            return SEARCH_DEPTH;
+        }
+        int depth = DEPTH_MIN;
+        if (game.get_max_val() < DEPTH_EASY_MAX)
+        {
+            return depth;
+        }
+        int empty_num = game.get_empty_num();
+        double step = DEPTH_STEP + DEPTH_STEP_EMPTY*empty_num;
+        double cost = DEPTH_NODES*(empty_num + 2);
+        for (int d = 4; d <= depth; d += 2)
+        {
+            cost *= step;
+        }
+        int cap = distinct_num(game) - DEPTH_DISTINCT_OFFSET;
+        while (depth + 2 <= DEPTH_MAX && depth < cap && cost*step <= DEPTH_BUDGET)
+        {
+            depth += 2;
+            cost *= step;
+        }
+        return depth;
+    }
+
+    void clear_depth_stats(void)
+    {
+        for (int d = 0; d <= DEPTH_LIMIT; ++d)
+        {
+            depth_moves[d] = depth_nodes[d] = 0;
+            depth_us[d] = 0;
+        }
+    }
+
+    void print_depth_stats(void)
+    {
+        printf("depth  moves      nodes/move  us/move\n");
+        for (int d = 0; d <= DEPTH_LIMIT; ++d)
+        {
+            if (depth_moves[d])
+            {
+                printf("%5d %6lld %15.1lf %8.1lf\n", d, depth_moves[d],
+                    (double)depth_nodes[d]/depth_moves[d], depth_us[d]/depth_moves[d]);
+            }
         }
     }
 
     int solve(const game2048 &game)
     {
+        node_count = 0;
+        if (EXACT_TABLE && EXACT_TABLE->ready() && EXACT_TABLE->get_size() == game.get_size())
+        {
+            int opt_i = EXACT_TABLE->best_move(game, &last_value);
+            if (opt_i >= 0)
+            {
+                return opt_i;
+            }
+        }
+        if (ENGINE == ENGINE_MONTE_CARLO)
+        {
+            int opt_i = montecarlo::solve(game);
+            node_count = montecarlo::last_rollouts;
+            last_value = montecarlo::last_value;
+            return opt_i;
+        }
         double eval[4];
+        int mask = game.get_move_mask();
+        if (!game.undoable())
+        {
+            // too large to search in place: one move deep, on copies
+            last_depth = 0;
+            int best = 0;
+            for (int opt_i = 0; opt_i < 4; ++opt_i)
+            {
+                eval[opt_i] = -DOUBLE_INF*2;
+                if (mask >> opt_i & 1)
+                {
+                    game2048 node(game);
+                    node.opt(opt_i);
+                    eval[opt_i] = evaluater::eval(node);
+                    ++node_count;
+                }
+                best = eval[opt_i] > eval[best]? opt_i: best;
+            }
+            last_value = eval[best];
+            return best;
+        }
+        std::chrono::steady_clock::time_point start_t = std::chrono::steady_clock::now();
+        last_depth = pick_depth(game);
+        TABLE->new_search();
+        game2048 node(game);
         for (int opt_i = 0; opt_i < 4; ++opt_i)
         {
-            game2048 node(game);
-            eval[opt_i] = (node.opt(opt_i) == -1)
-            ? -DOUBLE_INF*2
-            : minimax(node, SEARCH_DEPTH, PC_SIDE, -DOUBLE_INF, DOUBLE_INF);
+            eval[opt_i] = -DOUBLE_INF*2;
+            if (mask >> opt_i & 1)
+            {
+                undo_token token = node.apply(opt_i);
+                eval[opt_i] = minimax(node, last_depth, PC_SIDE, -DOUBLE_INF, DOUBLE_INF);
+                node.undo(token);
+            }
         }
         int max_eval_i = 0;
         for (int i = 1; i < 4; ++i)
@@ -195,8 +689,197 @@ namespace solver
                 max_eval_i = i;
             }
         }
+        last_value = eval[max_eval_i];
+        ++depth_moves[last_depth];
+        depth_nodes[last_depth] += node_count;
+        depth_us[last_depth] += std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start_t).count();
         return max_eval_i;
     }
+
+    // boards solve_batch() searches at once
+    const int INTERLEAVE_WIDTH = 4;
+
+    // one board of solve_batch(): its root moves and stack of nodes
+    struct batch_search
+    {
+        int index;
+        game2048 *node;
+        int depth;
+        int mask;
+        int opt_i; // root move being searched
+        undo_token token;
+        double eval[4];
+        int top; // nodes on the stack
+        bool probe; // the top node waits for node_probe()
+        std::vector<search_node> stack;
+        long long nodes;
+    };
+
+    // a node's value to its parent, the board's root move when none
+    inline void batch_return(batch_search &b, double value)
+    {
+        if (--b.top)
+        {
+            node_child(*b.node, b.stack[b.top - 1], value);
+            return;
+        }
+        b.eval[b.opt_i] = value;
+        b.node->undo(b.token);
+    }
+
+    // runs b until the next node needs a table probe, with its bucket
+    // prefetched; false once the root moves are all searched
+    bool batch_step(batch_search &b)
+    {
+        game2048 &node = *b.node;
+        last_depth = b.depth;
+        long long nodes0 = node_count;
+        double value;
+        while (true)
+        {
+            if (!b.top)
+            {
+                while (++b.opt_i < 4 && !(b.mask >> b.opt_i & 1));
+                if (b.opt_i == 4)
+                {
+                    b.nodes += node_count - nodes0;
+                    return false;
+                }
+                b.token = node.apply(b.opt_i);
+                ++b.top;
+                if (node_enter(node, b.stack[0], b.depth, PC_SIDE, -DOUBLE_INF, DOUBLE_INF, value))
+                {
+                    batch_return(b, value);
+                    continue;
+                }
+                b.probe = true;
+                break;
+            }
+            search_node &s = b.stack[b.top - 1];
+            if (b.probe)
+            {
+                b.probe = false;
+                if (node_probe(node, s, value))
+                {
+                    batch_return(b, value);
+                    continue;
+                }
+            }
+            if (!node_next(node, s))
+            {
+                batch_return(b, node_close(node, s));
+                continue;
+            }
+            if (node_enter(node, b.stack[b.top], s.depth - 1, !s.side, s.alpha, s.beta, value))
+            {
+                node_child(node, s, value);
+                continue;
+            }
+            ++b.top;
+            b.probe = true;
+            break;
+        }
+        TABLE->prefetch(b.stack[b.top - 1].key);
+        b.nodes += node_count - nodes0;
+        return true;
+    }
+
+    // solve() for n boards on this thread, the same search with up to
+    // `width` boards in flight: each switches to the next at every table
+    // probe, after prefetching its bucket, so the probe's cache miss is
+    // served while the others search. Boards solve() would not search
+    // with minimax go to solve() one by one. node_count gets the total.
+    void solve_batch(game2048 *const *games, int n, int *moves, double *values=NULL,
+        int width=INTERLEAVE_WIDTH)
+    {
+        std::chrono::steady_clock::time_point start_t = std::chrono::steady_clock::now();
+        long long total = 0;
+        int searched = 0;
+        int batch_moves[DEPTH_LIMIT + 1] = {};
+        std::vector<batch_search> slots;
+        int next = 0;
+        width = width > 0? width: 1;
+        while (next < n || !slots.empty())
+        {
+            // fill the free slots
+            while (next < n && int(slots.size()) < width)
+            {
+                int k = next++;
+                const game2048 &game = *games[k];
+                bool exact = EXACT_TABLE && EXACT_TABLE->ready() &&
+                    EXACT_TABLE->get_size() == game.get_size();
+                if (exact || ENGINE != ENGINE_MINIMAX || !game.undoable())
+                {
+                    moves[k] = solve(game);
+                    if (values)
+                    {
+                        values[k] = last_value;
+                    }
+                    total += node_count;
+                    continue;
+                }
+                slots.push_back(batch_search());
+                batch_search &b = slots.back();
+                b.index = k;
+                b.node = new game2048(game);
+                b.depth = pick_depth(game);
+                b.mask = game.get_move_mask();
+                b.opt_i = -1;
+                for (int opt_i = 0; opt_i < 4; ++opt_i)
+                {
+                    b.eval[opt_i] = -DOUBLE_INF*2;
+                }
+                b.top = 0;
+                b.probe = false;
+                b.stack.resize(b.depth + 1);
+                b.nodes = 0;
+                TABLE->new_search();
+            }
+            for (size_t i = 0; i < slots.size(); )
+            {
+                batch_search &b = slots[i];
+                if (batch_step(b))
+                {
+                    ++i;
+                    continue;
+                }
+                int max_eval_i = 0;
+                for (int k = 1; k < 4; ++k)
+                {
+                    if (b.eval[k] > b.eval[max_eval_i])
+                    {
+                        max_eval_i = k;
+                    }
+                }
+                moves[b.index] = max_eval_i;
+                last_value = b.eval[max_eval_i];
+                if (values)
+                {
+                    values[b.index] = last_value;
+                }
+                total += b.nodes;
+                ++searched;
+                ++batch_moves[b.depth];
+                ++depth_moves[b.depth];
+                depth_nodes[b.depth] += b.nodes;
+                delete b.node;
+                // keeps the round-robin order of the rest
+                slots.erase(slots.begin() + i);
+            }
+        }
+        node_count = total;
+        if (searched)
+        {
+            // time in flight overlaps, so each board gets an even share
+            double us = std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - start_t).count();
+            for (int d = 0; d <= DEPTH_LIMIT; ++d)
+            {
+                depth_us[d] += us*batch_moves[d]/searched;
+            }
+        }
+    }
 }
 
 
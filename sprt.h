@@ -0,0 +1,241 @@
+#ifndef SPRT_H
+#define SPRT_H
+
+#include "game2048.h"
+#include "solver.h"
+#include "optimizer.h"
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Plays two weight sets against each other on paired games: pair k
+// gives both sides the same spawn seed. The per-pair differences go
+// into a sequential probability ratio test (normal approximation)
+// of "A is better by delta" against "B is better by delta", and play
+// stops at the first bound crossed or after max_pairs.
+
+const int SPRT_MIN_PAIRS = 16; // before the variance is trusted
+const int SPRT_MAX_PAIRS = 2000;
+const double SPRT_ALPHA = 0.05;
+const double SPRT_BETA = 0.05;
+const double SPRT_DELTA_SCORE = 2000; // points
+const double SPRT_DELTA_RATE = 0.05; // share of games reaching target
+const int SPRT_PRINT_STEP = 10;
+// per worker thread, 4 MB; cleared before every game
+const int SPRT_TT_BITS = 18;
+
+// sprt::run results
+const int SPRT_A = 1;
+const int SPRT_B = -1;
+const int SPRT_NONE = 0;
+
+
+namespace sprt
+{
+    struct pair_result
+    {
+        bool ready;
+        int score[2];
+        int max_val[2];
+    };
+
+    struct shared
+    {
+        const creature *side[2];
+        uint32_t seed;
+        int max_pairs;
+        std::mutex lock;
+        std::condition_variable done_ready;
+        std::vector<pair_result> results;
+        int next;
+        bool quit;
+    };
+
+    // a file holding a log/G* line (the first one is used), or "-" for
+    // the built-in weights
+    bool load_config(const char *name, creature &c)
+    {
+        if (!strcmp(name, "-"))
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                c.param[i] = evaluater::WEIGHTS[i];
+            }
+            c.param[3] = evaluater::SVK1;
+            c.param[4] = evaluater::SVK2;
+            for (int i = 5; i < PARAM_NUM; ++i)
+            {
+                c.param[i] = evaluater::WEIGHTS[i - 2];
+            }
+            c.reset_test_data();
+            return true;
+        }
+        std::ifstream file(name);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (c.parse(line.c_str()))
+            {
+                c.reset_test_data();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline uint32_t pair_seed(uint32_t seed, int k)
+    {
+        return (seed ^ uint32_t(k)*0x9e3779b9u) | 1;
+    }
+
+    void worker(shared *s)
+    {
+        // cleared before every game, as creature::eval does, so games
+        // neither read the other side's values nor depend on the games
+        // this thread played before
+        trans_table table(SPRT_TT_BITS, false);
+        solver::TABLE = &table;
+        game2048 game;
+        while (true)
+        {
+            int k;
+            {
+                std::lock_guard<std::mutex> guard(s->lock);
+                if (s->quit || s->next >= s->max_pairs)
+                {
+                    return;
+                }
+                k = s->next++;
+            }
+            pair_result r;
+            for (int side = 0; side < 2; ++side)
+            {
+                uint32_t seed = pair_seed(s->seed, k);
+                s->side[side]->apply();
+                table.clear();
+                self_play(game, seed);
+                r.score[side] = game.get_score();
+                r.max_val[side] = game.get_max_val();
+            }
+            r.ready = true;
+            std::lock_guard<std::mutex> guard(s->lock);
+            s->results[k] = r;
+            s->done_ready.notify_one();
+        }
+    }
+
+    // target: tile (e.g. 2048) whose reach rate is compared, 0 for the
+    // score; delta: 0 for the default of the metric; max_pairs >= 1
+    int run(const creature &a, const creature &b, int target=0, double delta=0,
+        int max_pairs=SPRT_MAX_PAIRS, int thread_num=0)
+    {
+        if (max_pairs < 1)
+        {
+            return SPRT_NONE;
+        }
+        if (thread_num <= 0)
+        {
+            thread_num = std::thread::hardware_concurrency();
+            thread_num = thread_num > 0? thread_num: 1;
+        }
+        if (delta <= 0)
+        {
+            delta = target? SPRT_DELTA_RATE: SPRT_DELTA_SCORE;
+        }
+        int target_val = 0;
+        while (target && (1 << target_val) < target)
+        {
+            ++target_val;
+        }
+        shared s;
+        s.side[0] = &a;
+        s.side[1] = &b;
+        s.seed = uint32_t(time(0));
+        s.max_pairs = max_pairs;
+        s.results.assign(max_pairs, pair_result());
+        for (int k = 0; k < max_pairs; ++k)
+        {
+            s.results[k].ready = false;
+        }
+        s.next = 0;
+        s.quit = false;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers.push_back(std::thread(worker, &s));
+        }
+
+        // pairs are folded in order of k, so the test sees the same
+        // sequence whatever the number of threads
+        const double lower = log(SPRT_BETA/(1 - SPRT_ALPHA));
+        const double upper = log((1 - SPRT_BETA)/SPRT_ALPHA);
+        double mean[2] = {0, 0};
+        double sum = 0;
+        double sum2 = 0;
+        double llr = 0;
+        int verdict = SPRT_NONE;
+        int n = 0;
+        printf("pairs|         A|         B|      diff|    LLR [%5.2lf, %4.2lf]\n", lower, upper);
+        while (n < max_pairs && verdict == SPRT_NONE)
+        {
+            pair_result r;
+            {
+                std::unique_lock<std::mutex> guard(s.lock);
+                s.done_ready.wait(guard, [&s, n] { return s.results[n].ready; });
+                r = s.results[n];
+            }
+            double x[2];
+            for (int side = 0; side < 2; ++side)
+            {
+                x[side] = target? r.max_val[side] >= target_val: r.score[side];
+                mean[side] += x[side];
+            }
+            double d = x[0] - x[1];
+            sum += d;
+            sum2 += d*d;
+            ++n;
+            double var = (sum2 - sum*sum/n)/(n - 1 > 0? n - 1: 1);
+            if (n >= SPRT_MIN_PAIRS && var > 0)
+            {
+                // log likelihood ratio of mean d = delta against -delta
+                llr = 2*delta*sum/var;
+                verdict = llr >= upper? SPRT_A: llr <= lower? SPRT_B: SPRT_NONE;
+            }
+            if (n % SPRT_PRINT_STEP == 0 || verdict != SPRT_NONE)
+            {
+                printf("%5d| %9.3lf| %9.3lf| %9.3lf| %7.3lf\n", n, mean[0]/n, mean[1]/n, sum/n, llr);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.quit = true;
+        }
+        for (int t = 0; t < thread_num; ++t)
+        {
+            workers[t].join();
+        }
+        if (target)
+        {
+            printf("metric: reach %d, delta %.3lf\n", target, delta);
+        }
+        else
+        {
+            printf("metric: score, delta %.1lf\n", delta);
+        }
+        printf("result: %s\n", verdict == SPRT_A? "A is stronger":
+            verdict == SPRT_B? "B is stronger": "inconclusive");
+        return verdict;
+    }
+}
+
+
+
+#endif
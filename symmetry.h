@@ -0,0 +1,145 @@
+#ifndef SYMMETRY_H
+#define SYMMETRY_H
+
+#include "game2048.h"
+#include <cstdint>
+
+
+// The 8 symmetries of a square board, numbered s = r + 4*m: r quarter
+// turns clockwise, then a left-right mirror if m. Symmetry s moves the
+// tile at (i, j) to sym_cell(s, ...) and turns move opt_i into
+// sym_move(s, opt_i).
+
+const int SYM_NUM = 8;
+
+
+inline int sym_inverse(int s)
+{
+    // mirrored ones are reflections and undo themselves
+    return s & 4? s: (4 - s) & 3;
+}
+
+inline int sym_cell(int s, int c, int size)
+{
+    int i = c / size;
+    int j = c % size;
+    for (int r = 0; r < (s & 3); ++r)
+    {
+        int t = i;
+        i = j;
+        j = size - 1 - t;
+    }
+    if (s & 4)
+    {
+        j = size - 1 - j;
+    }
+    return i*size + j;
+}
+
+// 0 up, 1 right, 2 down, 3 left: a quarter turn clockwise adds one,
+// the mirror swaps left and right
+inline int sym_move(int s, int opt_i)
+{
+    opt_i = (opt_i + s) & 3;
+    return s & 4? (4 - opt_i) & 3: opt_i;
+}
+
+inline int sym_move_inverse(int s, int opt_i)
+{
+    if (s & 4)
+    {
+        opt_i = (4 - opt_i) & 3;
+    }
+    return (opt_i - s) & 3;
+}
+
+
+// 4x4 boards packed 4 bits per cell, row major, cell (0, 0) in the
+// highest nibble
+
+inline uint64_t sym_hflip(uint64_t x)
+{
+    return ((x & 0x000f000f000f000fULL) << 12) | ((x & 0x00f000f000f000f0ULL) << 4) |
+        ((x & 0x0f000f000f000f00ULL) >> 4) | ((x & 0xf000f000f000f000ULL) >> 12);
+}
+
+inline uint64_t sym_vflip(uint64_t x)
+{
+    return (x << 48) | ((x & 0xffff0000ULL) << 16) |
+        ((x >> 16) & 0xffff0000ULL) | (x >> 48);
+}
+
+inline uint64_t sym_transpose(uint64_t x)
+{
+    uint64_t a = (x & 0xf0f00f0ff0f00f0fULL) |
+        ((x & 0x0000f0f00000f0f0ULL) << 12) | ((x & 0x0f0f00000f0f0000ULL) >> 12);
+    return (a & 0xff00ff0000ff00ffULL) |
+        ((a & 0x00ff00ff00000000ULL) >> 24) | ((a & 0x00000000ff00ff00ULL) << 24);
+}
+
+// all 8 images of a packed board, indexed by symmetry
+inline void sym_all(uint64_t x, uint64_t *image)
+{
+    uint64_t t = sym_transpose(x);
+    uint64_t v = sym_vflip(x);
+    uint64_t tv = sym_vflip(t);
+    image[0] = x;
+    image[1] = sym_hflip(t);
+    image[2] = sym_hflip(v);
+    image[3] = tv;
+    image[4] = sym_hflip(x);
+    image[5] = t;
+    image[6] = v;
+    image[7] = sym_hflip(tv);
+}
+
+// smallest image of the board and the symmetry that produces it
+inline uint64_t sym_canonical(uint64_t x, int &sym)
+{
+    uint64_t image[SYM_NUM];
+    sym_all(x, image);
+    sym = 0;
+    for (int s = 1; s < SYM_NUM; ++s)
+    {
+        if (image[s] < image[sym])
+        {
+            sym = s;
+        }
+    }
+    return image[sym];
+}
+
+// false if the board isn't 4x4 or has a tile above 2^15
+inline bool sym_pack(const game2048 &node, uint64_t &x)
+{
+    if (node.get_size() != 4)
+    {
+        return false;
+    }
+    x = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            if (node.get(i, j) > 15)
+            {
+                return false;
+            }
+            x = x << 4 | uint64_t(node.get(i, j));
+        }
+    }
+    return true;
+}
+
+// the 4x4 board sym_pack gave x
+inline void sym_unpack(uint64_t x, game2048 &node)
+{
+    for (int c = 15; c >= 0; --c, x >>= 4)
+    {
+        node.set(c / 4, c % 4, int(x & 0xf));
+    }
+}
+
+
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef TABLEMEM_H
+#define TABLEMEM_H
+
+#include <cstdio>
+#include <cstdint>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+// Memory for the large, randomly probed tables (transposition tables,
+// n-tuple weights). Tables of TM_MIN_HUGE or more are backed by huge
+// pages when the system has them: explicit ones (MAP_HUGETLB) if
+// reserved, else 2 MB aligned transparent ones (MADV_HUGEPAGE). On
+// NUMA machines a table shared by all search threads is interleaved
+// over the nodes and a table owned by one thread prefers the node it
+// runs on. Anything not available falls back to plain pages.
+
+const size_t TM_PAGE = 4096;
+const size_t TM_HUGE_PAGE = size_t(2) << 20;
+const size_t TM_MIN_HUGE = TM_HUGE_PAGE;
+const int TM_MAX_NODES = 64;
+
+// what tablemem::last_kind reports
+const int TM_HUGETLB = 1;
+const int TM_THP = 2;
+const int TM_INTERLEAVE = 4;
+const int TM_LOCAL = 8;
+
+// <linux/mempolicy.h> modes, without the libnuma dependency
+const int TM_MPOL_PREFERRED = 1;
+const int TM_MPOL_INTERLEAVE = 3;
+
+
+namespace tablemem
+{
+    bool HUGE_PAGES = true;
+    bool NUMA = true;
+
+    // how the last alloc() on this thread was backed
+    thread_local int last_kind;
+
+    int node_num(void)
+    {
+        static int n = 0;
+        if (!n)
+        {
+            char path[64];
+            do
+            {
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+            }while (n < TM_MAX_NODES && !access(path, F_OK) && ++n);
+            n = n? n: 1;
+        }
+        return n;
+    }
+
+    inline size_t mapped_len(size_t bytes)
+    {
+        size_t step = bytes >= TM_MIN_HUGE? TM_HUGE_PAGE: TM_PAGE;
+        return (bytes + step - 1) / step * step;
+    }
+
+    void set(bool huge_pages, bool numa=true)
+    {
+        HUGE_PAGES = huge_pages;
+        NUMA = numa;
+    }
+
+    // zeroed; shared: probed by many threads rather than by the caller
+    // alone. Throws std::bad_alloc like new.
+    void* alloc(size_t bytes, bool shared=true)
+    {
+        last_kind = 0;
+        size_t len = mapped_len(bytes);
+        bool huge = HUGE_PAGES && bytes >= TM_MIN_HUGE;
+        void *p = MAP_FAILED;
+        if (huge)
+        {
+            p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            last_kind |= p != MAP_FAILED? TM_HUGETLB: 0;
+        }
+        if (p == MAP_FAILED)
+        {
+            // over-allocated by a huge page so the table can start on a
+            // huge page boundary, and the ends trimmed
+            size_t extra = len >= TM_HUGE_PAGE? TM_HUGE_PAGE: 0;
+            char *raw = (char*)mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED)
+            {
+                throw std::bad_alloc();
+            }
+            char *start = raw;
+            if (extra)
+            {
+                start = (char*)((uintptr_t(raw) + TM_HUGE_PAGE - 1) & ~(TM_HUGE_PAGE - 1));
+                if (start > raw)
+                {
+                    munmap(raw, start - raw);
+                }
+                if (raw + extra > start)
+                {
+                    munmap(start + len, raw + extra - start);
+                }
+            }
+            p = start;
+            if (huge && !madvise(p, len, MADV_HUGEPAGE))
+            {
+                last_kind |= TM_THP;
+            }
+        }
+        int nodes = node_num();
+        if (NUMA && nodes > 1)
+        {
+            unsigned long mask = 0;
+            int mode = TM_MPOL_INTERLEAVE;
+            if (shared)
+            {
+                mask = nodes >= 64? ~0UL: (1UL << nodes) - 1;
+            }
+            else
+            {
+                unsigned cpu = 0;
+                unsigned node = 0;
+                syscall(SYS_getcpu, &cpu, &node, NULL);
+                mask = 1UL << (node % TM_MAX_NODES);
+                mode = TM_MPOL_PREFERRED;
+            }
+            // before the first touch, which is where pages get placed
+            if (!syscall(SYS_mbind, p, len, mode, &mask, sizeof(mask)*8, 0))
+            {
+                last_kind |= shared? TM_INTERLEAVE: TM_LOCAL;
+            }
+        }
+        return p;
+    }
+
+    // bytes as given to alloc()
+    void release(void *p, size_t bytes)
+    {
+        if (p)
+        {
+            munmap(p, mapped_len(bytes));
+        }
+    }
+
+    // e.g. "thp interleave", "plain"
+    void describe(int kind, char *buf, size_t n)
+    {
+        snprintf(buf, n, "%s%s%s%s%s",
+            kind & TM_HUGETLB? "hugetlb ": "", kind & TM_THP? "thp ": "",
+            kind & TM_INTERLEAVE? "interleave ": "", kind & TM_LOCAL? "local ": "",
+            kind & (TM_HUGETLB | TM_THP)? "": "plain");
+    }
+}
+
+
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef TRANSPOSITION_H
+#define TRANSPOSITION_H
+
+#include "game2048.h"
+#include "symmetry.h"
+#include "tablemem.h"
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+
+
+// 2^TT_BITS entries, 16 bytes each
+const int TT_BITS = 20;
+// entries not touched by the last TT_MAX_AGE searches are replaced first
+const int TT_MAX_AGE = 4;
+
+const int TT_EXACT = 0;
+const int TT_LOWER = 1; // value >= stored
+const int TT_UPPER = 2; // value <= stored
+const int TT_BOUND_MASK = 3;
+// or-ed into the flag by searches that expand only some spawn cells;
+// their values are estimates, not bounds, for a full-width search
+const int TT_SELECTIVE = 4;
+
+const uint64_t TT_PC_SIDE_KEY = 0x9e3779b97f4a7c15ULL;
+
+
+// check is key ^ the other 8 bytes, so an entry torn by a concurrent
+// store fails the check instead of returning another board's data
+struct tt_entry
+{
+    uint64_t check;
+    float value;
+    int8_t depth;
+    uint8_t flag;
+    int8_t move; // direction for player nodes, cell index for pc nodes,
+                 // both in the orientation of the key
+    uint8_t age;
+};
+
+
+class trans_table
+{
+public:
+    // shared: probed by several threads, not only its owner
+    trans_table(int bits=TT_BITS, bool shared=true);
+    ~trans_table();
+
+    void clear(void);
+    void new_search(void);
+
+    // false on a miss; e gets a consistent copy of the entry
+    bool probe(uint64_t key, tt_entry &e);
+    inline void prefetch(uint64_t key) const;
+    void store(uint64_t key, int depth, double value, int flag, int move);
+
+    // approximate while another thread is searching: relaxed loads
+    // and stores, not read-modify-writes, so counts may be lost but a
+    // probe costs no locked instruction
+    std::atomic<long long> probe_count;
+    std::atomic<long long> hit_count;
+
+private:
+    tt_entry* entries;
+    uint64_t mask;
+    std::atomic<uint8_t> age;
+
+    inline uint64_t index(uint64_t key) const;
+    static inline void count(std::atomic<long long> &n);
+    inline int stale(const tt_entry &e) const;
+};
+
+
+inline uint64_t tt_data(const tt_entry &e)
+{
+    uint64_t data;
+    memcpy(&data, &e.value, sizeof(data));
+    return data;
+}
+
+inline uint64_t tt_key(const tt_entry &e)
+{
+    return e.check ^ tt_data(e);
+}
+
+
+// splitmix64 finalizer
+inline uint64_t tt_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+
+// 4x4 boards below 2^16 are keyed by their canonical image under the 8
+// symmetries, so mirrored and rotated positions share one entry; sym
+// is the symmetry that maps the board onto the key. Other boards get a
+// Zobrist style key, the XOR of a hash of every (cell, value), and sym
+// is 0; those collide only by chance, as any 64-bit key may.
+inline uint64_t board_key(const game2048 &node, bool pc_side, int &sym)
+{
+    uint64_t key;
+    if (sym_pack(node, key))
+    {
+        key = sym_canonical(key, sym);
+    }
+    else
+    {
+        sym = 0;
+        int size = node.get_size();
+        key = tt_mix(uint64_t(size));
+        for (int c = 0; c < size*size; ++c)
+        {
+            uint64_t v = uint32_t(node.get(c / size, c % size));
+            key ^= tt_mix((uint64_t(c + 1) << 32 | v) + TT_PC_SIDE_KEY);
+        }
+    }
+    return pc_side? key ^ TT_PC_SIDE_KEY: key;
+}
+
+
+trans_table::trans_table(int bits /*=TT_BITS*/, bool shared /*=true*/)
+{
+    mask = (uint64_t(1) << bits) - 1;
+    entries = (tt_entry*)tablemem::alloc(sizeof(tt_entry)*(mask + 1), shared);
+    clear();
+}
+
+trans_table::~trans_table()
+{
+    tablemem::release(entries, sizeof(tt_entry)*(mask + 1));
+}
+
+
+void trans_table::clear(void)
+{
+    for (uint64_t i = 0; i <= mask; ++i)
+    {
+        entries[i].value = 0;
+        entries[i].depth = -1;
+        entries[i].flag = 0;
+        entries[i].move = -1;
+        entries[i].age = 0;
+        entries[i].check = ~tt_data(entries[i]);
+    }
+    age = 0;
+    probe_count = 0;
+    hit_count = 0;
+}
+
+void trans_table::new_search(void)
+{
+    ++age;
+}
+
+
+inline uint64_t trans_table::index(uint64_t key) const
+{
+    // low bit selects the slot in a 2-entry bucket
+    return tt_mix(key) & mask & ~uint64_t(1);
+}
+
+inline void trans_table::count(std::atomic<long long> &n)
+{
+    n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+inline int trans_table::stale(const tt_entry &e) const
+{
+    return uint8_t(age.load(std::memory_order_relaxed) - e.age) > TT_MAX_AGE;
+}
+
+
+// pulls the bucket of key towards the cache ahead of a probe
+inline void trans_table::prefetch(uint64_t key) const
+{
+    __builtin_prefetch(entries + index(key));
+}
+
+bool trans_table::probe(uint64_t key, tt_entry &e)
+{
+    const tt_entry *bucket = entries + index(key);
+    count(probe_count);
+    for (int i = 0; i < 2; ++i)
+    {
+        e = bucket[i];
+        if (e.depth >= 0 && tt_key(e) == key)
+        {
+            count(hit_count);
+            return true;
+        }
+    }
+    return false;
+}
+
+// lockless: every thread writes whole entries and readers verify them,
+// a lost or torn store only costs a miss
+void trans_table::store(uint64_t key, int depth, double value, int flag, int move)
+{
+    tt_entry *bucket = entries + index(key);
+    tt_entry old[2] = {bucket[0], bucket[1]};
+    int k = 0;
+    if (tt_key(old[1]) == key)
+    {
+        k = 1;
+    }
+    else if (tt_key(old[0]) != key)
+    {
+        // replace stale entries first, then the shallower one
+        int s0 = stale(old[0]);
+        int s1 = stale(old[1]);
+        if (s0 != s1)
+        {
+            k = s1;
+        }
+        else if (old[1].depth < old[0].depth)
+        {
+            k = 1;
+        }
+    }
+    if (tt_key(old[k]) == key && old[k].depth > depth && !stale(old[k]) &&
+        (flag & TT_SELECTIVE) >= (old[k].flag & TT_SELECTIVE))
+    {
+        // keep the deeper result for this position, unless it is
+        // selective and this one is not
+        return;
+    }
+    tt_entry e;
+    e.value = float(value);
+    e.depth = int8_t(depth);
+    e.flag = uint8_t(flag);
+    e.move = int8_t(move);
+    e.age = age.load(std::memory_order_relaxed);
+    e.check = key ^ tt_data(e);
+    bucket[k] = e;
+}
+
+
+#endif